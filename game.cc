@@ -11,9 +11,35 @@
 // already existing tokens. The first player who cannot play a legal
 // move (during their turn) loses.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <map>
+#include <memory>
 #include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -32,6 +58,8 @@ const char P2 = 2;
 const int LOSS_VALUE = -1000;
 const int WIN_VALUE = +1000;
 const int INF = 1000000;
+// Searches never go deeper than this many plies.
+const int MAX_PLY = 32;
 const int MOVES[] = {1, -1, 7, -7, 6, -6, 8, -8};
 const int SCORE_PER_CELL = 16;
 
@@ -41,8 +69,21 @@ const int SCORE_PER_CELL = 16;
 #define POS_TO_X(pos) ((pos - 8) / 7)
 #define POS_TO_Y(pos) ((pos - 8) % 7)
 #define XY_TO_POS(x, y) (x*7+y+8)
+#define POS_TO_SQ(pos) (POS_TO_X(pos) * 5 + POS_TO_Y(pos))
+#define SQ_TO_POS(sq) XY_TO_POS((sq) / 5, (sq) % 5)
 #define DEBUG(x) ;
 
+// Moves of one position in a fixed size array, so that it lives on the
+// stack: a token has at most 16 queen moves, a placement 25 cells.
+const int MAX_MOVES = 32;
+
+struct MoveList {
+  int moves[MAX_MOVES];
+  int count;
+
+  MoveList() : count(0) {}
+};
+
 class Board {
  public:
   char board[49];
@@ -52,9 +93,22 @@ class Board {
   Board();
   bool hasLost(int i);
   bool isLegal(int x, int y);
+  bool canMove(char player, int pos);
+  int emptyCells();
+  // The cells player's token can move to, or every empty cell for a token
+  // that is not placed yet.
+  void generateMoves(char player, MoveList& list);
+  // The cells a token at from can move to: along the eight queen rays up
+  // to the first cell that is not empty.
+  void generateMovesFrom(int from, MoveList& list);
+  // Moves player's token to pos, leaving its old cell blocked, and returns
+  // that cell, or 0 for a placement.
+  int makeMove(char player, int pos);
+  // Takes back makeMove(player, pos), which returned from.
+  void unmakeMove(char player, int pos, int from);
   void play(int x, int y, char player);
-  void printBoard();
-  void printPossibleMoves(char player);
+  void printBoard(ostream& out);
+  void printPossibleMoves(char player, ostream& out);
 };
 
 Board::Board() {
@@ -73,6 +127,62 @@ bool Board::isLegal(int x, int y) {
   return board[x*7+y+8] == EMPTY;
 }
 
+// Whether player may move its token to pos. A token that is not placed
+// yet may go to any empty cell.
+bool Board::canMove(char player, int pos) {
+  if (pos < 8 || pos > 40 || board[pos] != EMPTY) return false;
+  int from = (player == P1) ? p1 : p2;
+  if (from == 0) return true;
+  for (int i = 0; i < 8; ++i) {
+    for (int p = from + MOVES[i]; board[p] == EMPTY; p += MOVES[i]) {
+      if (p == pos) return true;
+    }
+  }
+  return false;
+}
+
+void Board::generateMoves(char player, MoveList& list) {
+  int from = (player == P1) ? p1 : p2;
+  if (from != 0) {
+    generateMovesFrom(from, list);
+    return;
+  }
+  list.count = 0;
+  for (int pos = 8; pos <= 40; ++pos) {
+    if (board[pos] == EMPTY) list.moves[list.count++] = pos;
+  }
+}
+
+void Board::generateMovesFrom(int from, MoveList& list) {
+  list.count = 0;
+  for (int i = 0; i < 8; ++i) {
+    for (int pos = from + MOVES[i]; board[pos] == EMPTY; pos += MOVES[i]) {
+      list.moves[list.count++] = pos;
+    }
+  }
+}
+
+int Board::makeMove(char player, int pos) {
+  int& token = (player == P1) ? p1 : p2;
+  int from = token;
+  board[pos] = player;
+  token = pos;
+  return from;
+}
+
+void Board::unmakeMove(char player, int pos, int from) {
+  board[pos] = EMPTY;
+  ((player == P1) ? p1 : p2) = from;
+}
+
+int Board::emptyCells() {
+  int count = 0;
+  for (int i = 8; i < 41; ++i) {
+    if (board[i] == EMPTY) count++;
+  }
+  return count;
+}
+
 void Board::play(int x, int y, char player) {
   int pos = x*7+y+8;
   board[pos] = player;
@@ -82,44 +192,780 @@ void Board::play(int x, int y, char player) {
     p2 = pos; 
 }
 
-void Board::printBoard() {
+void Board::printBoard(ostream& out) {
   for (int i=1; i<6; ++i) {
-    cout << "| ";
+    out << "| ";
     for (int j=1; j<6; ++j) {
       char cell = board[i*7+j];
       if (cell == 0) {
-        cout << "  | "; 
+        out << "  | "; 
       } else {
         if (p1 == i*7+j || p2 == i*7+j) {
-          cout << PLAYER(cell) << " | ";
+          out << PLAYER(cell) << " | ";
         } else {
-          cout << "X | ";
+          out << "X | ";
         }
       }
     }
-    cout << endl;
+    out << '\n';
   }
 }
 
 bool Board::hasLost(int i) {
-  if (i == 0) return false;
+  // A token that is not placed yet can go to any empty cell.
+  if (i == 0) return emptyCells() == 0;
   if (board[i+1] == 0 || board[i-1] == 0 || board[i+7] == 0 || board[i-7] == 0 ||
       board[i+6] == 0 || board[i-6] == 0 || board[i+8] == 0 || board[i-8] == 0)
     return false;
   return true; 
 }
 
-class Mirror {
+// A position packed into the low 36 bits of a uint64:
+//   bits  0-24  occupancy, bit x*5+y set for a non empty cell (x, y)
+//   bits 25-29  p1 square x*5+y, or NO_SQUARE when not placed yet
+//   bits 30-34  p2 square, likewise
+//   bit  35     side to move, set when P2 is to move
+typedef uint64_t PackedPosition;
+const int NO_SQUARE = 31;
+const int PACKED_POSITION_BITS = 36;
+
+PackedPosition pack_position(Board& board, char player) {
+  PackedPosition packed = 0;
+  for (int sq = 0; sq < 25; ++sq) {
+    if (board.board[SQ_TO_POS(sq)] != EMPTY) packed |= 1ULL << sq;
+  }
+  packed |= (PackedPosition)(board.p1 ? POS_TO_SQ(board.p1) : NO_SQUARE) << 25;
+  packed |= (PackedPosition)(board.p2 ? POS_TO_SQ(board.p2) : NO_SQUARE) << 30;
+  if (player == P2) packed |= 1ULL << 35;
+  return packed;
+}
+
+// Cells that are occupied but hold no token are marked BORDER, since which
+// player visited them no longer matters.
+void unpack_position(PackedPosition packed, Board* board, char* player) {
+  *board = Board();
+  for (int sq = 0; sq < 25; ++sq) {
+    if (packed & (1ULL << sq)) board->board[SQ_TO_POS(sq)] = BORDER;
+  }
+  int p1 = (packed >> 25) & 31;
+  int p2 = (packed >> 30) & 31;
+  if (p1 != NO_SQUARE) board->play(p1 / 5, p1 % 5, P1);
+  if (p2 != NO_SQUARE) board->play(p2 / 5, p2 % 5, P2);
+  *player = (packed & (1ULL << 35)) ? P2 : P1;
+}
+
+// A game as a start position and the squares (x*5+y) played from it,
+// alternating sides starting with the side to move at the start.
+struct GameRecord {
+  PackedPosition start;
+  vector<int> moves;
+  // P1 or P2, or EMPTY when the game was not played to the end.
+  char winner;
+};
+
+// Encoded records are laid out as
+//   5 bytes  start position, little endian, with the winner in bits 36-37
+//   1 byte   number of moves
+//   n bytes  the moves as 5 bit squares, packed least significant bit first
+// A record of a full game from an empty board takes at most 22 bytes.
+const int MAX_RECORD_MOVES = 25;
+const int MAX_RECORD_BYTES = 6 + (MAX_RECORD_MOVES * 5 + 7) / 8;
+
+// Returns the number of bytes written to out, or 0 if the record can't be
+// encoded.
+int encode_record(const GameRecord& record, uint8_t* out) {
+  int count = record.moves.size();
+  if (count > MAX_RECORD_MOVES) return 0;
+  uint64_t head = record.start | ((uint64_t)record.winner << 36);
+  for (int i = 0; i < 5; ++i) out[i] = (uint8_t)(head >> (i * 8));
+  out[5] = (uint8_t)count;
+
+  int size = 6;
+  uint32_t bits = 0;
+  int nbits = 0;
+  for (int i = 0; i < count; ++i) {
+    bits |= (uint32_t)(record.moves[i] & 31) << nbits;
+    nbits += 5;
+    while (nbits >= 8) {
+      out[size++] = (uint8_t)bits;
+      bits >>= 8;
+      nbits -= 8;
+    }
+  }
+  if (nbits > 0) out[size++] = (uint8_t)bits;
+  return size;
+}
+
+// Returns the number of encoded bytes that follow the 6 byte head.
+int record_body_size(const uint8_t* head) {
+  return (head[5] * 5 + 7) / 8;
+}
+
+// Decodes a record whose head and body are in data. Returns false if the
+// record is malformed.
+bool decode_record(const uint8_t* data, GameRecord* record) {
+  uint64_t head = 0;
+  for (int i = 0; i < 5; ++i) head |= (uint64_t)data[i] << (i * 8);
+  int count = data[5];
+  if (count > MAX_RECORD_MOVES) return false;
+  record->start = head & ((1ULL << PACKED_POSITION_BITS) - 1);
+  record->winner = (char)((head >> 36) & 3);
+  record->moves.resize(count);
+
+  const uint8_t* body = data + 6;
+  uint32_t bits = 0;
+  int nbits = 0;
+  for (int i = 0; i < count; ++i) {
+    if (nbits < 5) {
+      bits |= (uint32_t)*body++ << nbits;
+      nbits += 8;
+    }
+    record->moves[i] = bits & 31;
+    if (record->moves[i] >= 25) return false;
+    bits >>= 5;
+    nbits -= 5;
+  }
+  return record->winner != 3;
+}
+
+// Record files start with a 4 byte magic and a version byte, followed by
+// encoded records back to back.
+const char RECORD_MAGIC[] = "ISOG";
+const uint8_t RECORD_VERSION = 1;
+
+class GameRecordWriter {
  public:
-  int getMove(Board* board, char player, int max_depth);
+  // Writes the file header.
+  GameRecordWriter(ostream* out);
+  bool write(const GameRecord& record);
+  bool ok() { return out->good(); }
+  long long count() { return records; }
 
  private:
-  Board* board;
+  ostream* out;
+  long long records;
+};
+
+GameRecordWriter::GameRecordWriter(ostream* out) : out(out), records(0) {
+  out->write(RECORD_MAGIC, 4);
+  out->put((char)RECORD_VERSION);
+}
+
+bool GameRecordWriter::write(const GameRecord& record) {
+  uint8_t buf[MAX_RECORD_BYTES];
+  int size = encode_record(record, buf);
+  if (size == 0) return false;
+  out->write((const char*)buf, size);
+  records++;
+  return out->good();
+}
+
+class GameRecordReader {
+ public:
+  // Reads and checks the file header.
+  GameRecordReader(istream* in);
+  // Returns false at the end of the stream or on a malformed record.
+  bool read(GameRecord* record);
+  // False if the header or a record was malformed.
+  bool ok() { return valid; }
+
+ private:
+  istream* in;
+  bool valid;
+};
+
+GameRecordReader::GameRecordReader(istream* in) : in(in) {
+  char header[5];
+  valid = in->read(header, 5) && memcmp(header, RECORD_MAGIC, 4) == 0 &&
+      (uint8_t)header[4] == RECORD_VERSION;
+}
+
+bool GameRecordReader::read(GameRecord* record) {
+  if (!valid) return false;
+  uint8_t buf[MAX_RECORD_BYTES];
+  if (!in->read((char*)buf, 6)) {
+    // A clean end of stream falls exactly on a record boundary.
+    valid = in->gcount() == 0;
+    return false;
+  }
+  int body = record_body_size(buf);
+  if (buf[5] > MAX_RECORD_MOVES || !in->read((char*)buf + 6, body) ||
+      !decode_record(buf, record)) {
+    valid = false;
+    return false;
+  }
+  return true;
+}
+
+// The 8 symmetries of the square board. SYMMETRY[t][sq] is the square
+// that sq (x*5+y) maps to under transform t, where bit 0 of t mirrors x,
+// bit 1 mirrors y and bit 2 swaps x and y.
+int SYMMETRY[8][25];
+int INVERSE_SYMMETRY[8][25];
+// Occupancy images of each byte of the 25 bit mask, for fast transforms.
+uint32_t SYMMETRY_OCCUPANCY[8][4][256];
+
+bool fill_symmetry() {
+  for (int t = 0; t < 8; ++t) {
+    for (int sq = 0; sq < 25; ++sq) {
+      int x = sq / 5;
+      int y = sq % 5;
+      if (t & 1) x = 4 - x;
+      if (t & 2) y = 4 - y;
+      if (t & 4) swap(x, y);
+      SYMMETRY[t][sq] = x*5+y;
+      INVERSE_SYMMETRY[t][x*5+y] = sq;
+    }
+    for (int chunk = 0; chunk < 4; ++chunk) {
+      for (int bits = 0; bits < 256; ++bits) {
+        uint32_t image = 0;
+        for (int b = 0; b < 8 && chunk*8+b < 25; ++b) {
+          if (bits & (1 << b)) image |= 1U << SYMMETRY[t][chunk*8+b];
+        }
+        SYMMETRY_OCCUPANCY[t][chunk][bits] = image;
+      }
+    }
+  }
+  return true;
+}
+
+// The tables are filled once, by the first lookup; the static's
+// initialization is safe when analysis workers start on several threads.
+void init_symmetry() {
+  static bool done = fill_symmetry();
+  (void)done;
+}
+
+PackedPosition transform_position(PackedPosition packed, int t) {
+  uint32_t occupancy = SYMMETRY_OCCUPANCY[t][0][packed & 255] |
+      SYMMETRY_OCCUPANCY[t][1][(packed >> 8) & 255] |
+      SYMMETRY_OCCUPANCY[t][2][(packed >> 16) & 255] |
+      SYMMETRY_OCCUPANCY[t][3][(packed >> 24) & 1];
+  int p1 = (packed >> 25) & 31;
+  int p2 = (packed >> 30) & 31;
+  if (p1 != NO_SQUARE) p1 = SYMMETRY[t][p1];
+  if (p2 != NO_SQUARE) p2 = SYMMETRY[t][p2];
+  return occupancy | ((PackedPosition)p1 << 25) | ((PackedPosition)p2 << 30) |
+      (packed & (1ULL << 35));
+}
+
+// Returns the smallest image of the position under the board symmetries,
+// and the transform that produces it.
+PackedPosition canonical_position(PackedPosition packed, int* transform) {
+  init_symmetry();
+  PackedPosition best = packed;
+  *transform = 0;
+  for (int t = 1; t < 8; ++t) {
+    PackedPosition image = transform_position(packed, t);
+    if (image < best) {
+      best = image;
+      *transform = t;
+    }
+  }
+  return best;
+}
+
+// How a stored score relates to the true value of a position.
+enum Bound { BOUND_NONE, BOUND_EXACT, BOUND_LOWER, BOUND_UPPER };
+
+// Scores beyond this are wins or losses at a known distance.
+const int WIN_THRESHOLD = WIN_VALUE - 100;
+
+// Negamax win and loss scores count plies from the root of the search.
+// Stored scores count them from the position itself instead.
+int score_to_stored(int score, int depth) {
+  if (score >= WIN_THRESHOLD) return score + depth;
+  if (score <= -WIN_THRESHOLD) return score - depth;
+  return score;
+}
+
+int score_from_stored(int score, int depth) {
+  if (score >= WIN_THRESHOLD) return score - depth;
+  if (score <= -WIN_THRESHOLD) return score + depth;
+  return score;
+}
+
+// A search result for a canonical position. depth is the remaining depth
+// (max_depth minus the depth of the position) that was searched, and move
+// is the best square in the canonical orientation, or NO_SQUARE.
+struct CacheEntry {
+  uint64_t key;
+  int16_t score;
+  uint8_t depth;
+  uint8_t bound;
+  uint8_t move;
+  uint8_t unused[3];
+};
+
+// Whether entry a should replace entry b for the same position: a deeper
+// search wins, and at equal depth an exact score beats a bound.
+bool cache_prefers(const CacheEntry& a, const CacheEntry& b) {
+  if (a.depth != b.depth) return a.depth > b.depth;
+  return a.bound == BOUND_EXACT || b.bound != BOUND_EXACT;
+}
+
+// A persistent analysis cache: an open addressed hash table of CacheEntry
+// in a file that is memory mapped read only, so it is usable at startup
+// without any parsing. Keys are canonical packed positions, which are
+// never 0, so a 0 key marks an empty slot.
+//
+// Results of this process are kept in memory until flush(), which merges
+// them into the file under an exclusive flock() on "<path>.lock": the
+// current file is re-read, merged with cache_prefers(), written to a
+// temporary file and renamed over the old one. Readers in other processes
+// keep their mapping of the old file, so they never see a partial table.
+class AnalysisCache {
+ public:
+  AnalysisCache();
+  ~AnalysisCache();
+  // Maps the cache file, if it exists. Returns false if it is invalid.
+  bool open(const string& path);
+  bool probe(PackedPosition key, CacheEntry* entry);
+  void store(const CacheEntry& entry);
+  // Merges this process's results into the file and maps the result.
+  bool flush();
+  long long size() { return mapped_count + pending.size(); }
+
+ private:
+  struct Header {
+    char magic[8];
+    uint64_t slots;
+    uint64_t count;
+  };
+
+  string path;
+  void* mapping;
+  size_t mapping_size;
+  const CacheEntry* slots;
+  uint64_t slot_mask;
+  long long mapped_count;
+  unordered_map<uint64_t, CacheEntry> pending;
+  mutex pending_lock;
+
+  void unmap();
+  static uint64_t slotOf(uint64_t key, uint64_t mask) {
+    return (key * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+  }
+};
+
+const char CACHE_MAGIC[8] = {'I', 'S', 'O', 'C', 'A', 'C', 'H', '1'};
+
+AnalysisCache::AnalysisCache()
+    : mapping(NULL), mapping_size(0), slots(NULL), slot_mask(0),
+      mapped_count(0) {}
+
+AnalysisCache::~AnalysisCache() {
+  unmap();
+}
+
+void AnalysisCache::unmap() {
+  if (mapping != NULL) munmap(mapping, mapping_size);
+  mapping = NULL;
+  slots = NULL;
+  mapped_count = 0;
+}
+
+bool AnalysisCache::open(const string& path) {
+  unmap();
+  this->path = path;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return errno == ENOENT;
+  struct stat st;
+  bool valid = false;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header)) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      const Header* header = (const Header*)data;
+      uint64_t n = header->slots;
+      valid = memcmp(header->magic, CACHE_MAGIC, 8) == 0 && n > 0 &&
+          (n & (n - 1)) == 0 &&
+          (uint64_t)st.st_size == sizeof(Header) + n * sizeof(CacheEntry);
+      if (valid) {
+        mapping = data;
+        mapping_size = st.st_size;
+        slots = (const CacheEntry*)(header + 1);
+        slot_mask = n - 1;
+        mapped_count = header->count;
+      } else {
+        munmap(data, st.st_size);
+      }
+    }
+  }
+  close(fd);
+  return valid;
+}
+
+bool AnalysisCache::probe(PackedPosition key, CacheEntry* entry) {
+  bool found = false;
+  if (slots != NULL) {
+    for (uint64_t i = slotOf(key, slot_mask); slots[i].key != 0;
+         i = (i + 1) & slot_mask) {
+      if (slots[i].key == key) {
+        *entry = slots[i];
+        found = true;
+        break;
+      }
+    }
+  }
+  lock_guard<mutex> lock(pending_lock);
+  unordered_map<uint64_t, CacheEntry>::iterator it = pending.find(key);
+  if (it != pending.end() && (!found || cache_prefers(it->second, *entry))) {
+    *entry = it->second;
+    found = true;
+  }
+  return found;
+}
+
+void AnalysisCache::store(const CacheEntry& entry) {
+  lock_guard<mutex> lock(pending_lock);
+  unordered_map<uint64_t, CacheEntry>::iterator it = pending.find(entry.key);
+  if (it == pending.end()) {
+    pending[entry.key] = entry;
+  } else if (cache_prefers(entry, it->second)) {
+    it->second = entry;
+  }
+}
+
+bool AnalysisCache::flush() {
+  lock_guard<mutex> lock(pending_lock);
+  if (pending.empty()) return true;
+  string lock_path = path + ".lock";
+  int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (lock_fd < 0) return false;
+  flock(lock_fd, LOCK_EX);
+
+  // Another process may have replaced the file since it was mapped.
+  unmap();
+  bool ok = open(path);
+  if (ok) {
+    unordered_map<uint64_t, CacheEntry> merged;
+    merged.swap(pending);
+    for (uint64_t i = 0; slots != NULL && i <= slot_mask; ++i) {
+      if (slots[i].key == 0) continue;
+      unordered_map<uint64_t, CacheEntry>::iterator it = merged.find(slots[i].key);
+      if (it == merged.end()) {
+        merged[slots[i].key] = slots[i];
+      } else if (!cache_prefers(it->second, slots[i])) {
+        it->second = slots[i];
+      }
+    }
+
+    // Keep the table at most half full.
+    uint64_t n = 1024;
+    while (n < merged.size() * 2) n *= 2;
+    vector<CacheEntry> table(n);
+    memset(table.data(), 0, n * sizeof(CacheEntry));
+    for (unordered_map<uint64_t, CacheEntry>::iterator it = merged.begin();
+         it != merged.end(); ++it) {
+      uint64_t i = slotOf(it->first, n - 1);
+      while (table[i].key != 0) i = (i + 1) & (n - 1);
+      table[i] = it->second;
+    }
+    Header header;
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.slots = n;
+    header.count = merged.size();
+
+    char tmp_path[32];
+    snprintf(tmp_path, sizeof(tmp_path), ".tmp.%d", (int)getpid());
+    string tmp = path + tmp_path;
+    FILE* out = fopen(tmp.c_str(), "wb");
+    ok = out != NULL &&
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(table.data(), sizeof(CacheEntry), n, out) == n;
+    if (out != NULL) ok = (fflush(out) == 0) && (fsync(fileno(out)) == 0) && ok;
+    if (out != NULL) ok = (fclose(out) == 0) && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+      unlink(tmp.c_str());
+      // Keep the results so that a later flush can retry.
+      pending.swap(merged);
+    }
+    ok = open(path) && ok;
+  }
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+  return ok;
+}
+
+// Zobrist keys of positions for the transposition table: one per occupied
+// cell, one per token square of each player, and one for P2 to move. An
+// unplaced token (square 25) has no key.
+uint64_t ZOBRIST_CELL[25];
+uint64_t ZOBRIST_TOKEN[2][26];
+uint64_t ZOBRIST_SIDE;
+
+bool fill_zobrist() {
+  mt19937_64 rng(20160101);
+  for (int sq = 0; sq < 25; ++sq) ZOBRIST_CELL[sq] = rng();
+  for (int side = 0; side < 2; ++side) {
+    for (int sq = 0; sq < 25; ++sq) ZOBRIST_TOKEN[side][sq] = rng();
+    ZOBRIST_TOKEN[side][25] = 0;
+  }
+  ZOBRIST_SIDE = rng();
+  return true;
+}
+
+// The keys are filled once, by whichever search needs them first; the
+// static's initialization is safe when searches start on several threads.
+void init_zobrist() {
+  static bool done = fill_zobrist();
+  (void)done;
+}
+
+uint64_t zobrist_key(const Board& board, char player) {
+  init_zobrist();
+  uint64_t key = (player == P2) ? ZOBRIST_SIDE : 0;
+  for (int sq = 0; sq < 25; ++sq) {
+    if (board.board[SQ_TO_POS(sq)] != EMPTY) key ^= ZOBRIST_CELL[sq];
+  }
+  if (board.p1 != 0) key ^= ZOBRIST_TOKEN[0][POS_TO_SQ(board.p1)];
+  if (board.p2 != 0) key ^= ZOBRIST_TOKEN[1][POS_TO_SQ(board.p2)];
+  return key;
+}
+
+// The packed position after player's token moves from from_sq (NO_SQUARE
+// if it was not placed) to to_sq: the key of a table with packed keys,
+// kept up to date the way a Zobrist key is.
+inline PackedPosition packed_move(PackedPosition packed, char player, int from_sq,
+                                  int to_sq) {
+  int shift = (player == P1) ? 25 : 30;
+  return packed ^ (1ULL << to_sq) ^ (1ULL << 35) ^
+      ((PackedPosition)(from_sq ^ to_sq) << shift);
+}
+
+// A search result in the transposition table. depth and score are as in
+// CacheEntry, move is a square or NO_SQUARE, and generation tells which
+// search stored it.
+struct TTEntry {
+  uint64_t key;
+  int16_t score;
+  uint8_t depth;
+  uint8_t bound;
+  uint8_t move;
+  uint8_t generation;
+  uint8_t unused[2];
+};
+
+// Four entries to a cache line.
+struct alignas(64) TTBucket {
+  TTEntry entries[4];
+};
+
+// An in-memory transposition table keyed by Zobrist keys. A store replaces
+// the entry of the same position if there is one, and otherwise the
+// shallowest entry of the bucket, entries from earlier searches counting
+// as shallower.
+//
+// With packed keys the key is the PackedPosition itself, which fits in the
+// key word, so two positions never share a key. The bucket is then picked
+// by a multiplicative hash of the key, since its low bits are just the
+// first cells of the board.
+//
+// Concurrent searches share the table without locks. The first word of a
+// stored entry is its key xor a 64-bit mix of its second word, so an entry
+// torn by two stores at once passes the key check only by the chance of a
+// 64-bit collision, packed keys or not.
+class TranspositionTable {
+ public:
+  TranspositionTable(bool packed_keys = false)
+      : packed_keys(packed_keys), bucket_mask(0), generation(0) {}
+  // Sizes the table to the largest power of two buckets within mb
+  // megabytes, and clears it.
+  void resize(int mb);
+  void clear();
+  // Starts a search, aging the entries of earlier ones.
+  void newSearch() { generation++; }
+  bool probe(uint64_t key, TTEntry* entry);
+  void store(uint64_t key, int score, int depth, Bound bound, int move);
+  // Permille of entries written by the current search.
+  int hashfull();
+
+ private:
+  vector<TTBucket> buckets;
+  bool packed_keys;
+  uint64_t bucket_mask;
+  atomic<uint8_t> generation;
+
+  TTBucket& bucketFor(uint64_t key) {
+    if (packed_keys) key = (key * 0x9E3779B97F4A7C15ULL) >> 28;
+    return buckets[key & bucket_mask];
+  }
+
+  static void load(const TTEntry* slot, TTEntry* entry);
+  static void save(TTEntry* slot, const TTEntry& entry);
+  // A bijective 64-bit finalizer; mix(0) is 0, so cleared slots stay empty.
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+};
+
+void TranspositionTable::load(const TTEntry* slot, TTEntry* entry) {
+  const uint64_t* words = (const uint64_t*)slot;
+  uint64_t check = __atomic_load_n(&words[0], __ATOMIC_RELAXED);
+  uint64_t data = __atomic_load_n(&words[1], __ATOMIC_RELAXED);
+  memcpy((char*)entry + 8, &data, 8);
+  entry->key = check ^ mix(data);
+}
+
+void TranspositionTable::save(TTEntry* slot, const TTEntry& entry) {
+  uint64_t data;
+  memcpy(&data, (const char*)&entry + 8, 8);
+  uint64_t* words = (uint64_t*)slot;
+  __atomic_store_n(&words[0], entry.key ^ mix(data), __ATOMIC_RELAXED);
+  __atomic_store_n(&words[1], data, __ATOMIC_RELAXED);
+}
+
+void TranspositionTable::resize(int mb) {
+  uint64_t count = 1;
+  while (count * 2 * sizeof(TTBucket) <= (uint64_t)mb << 20) count *= 2;
+  buckets.assign(count, TTBucket());
+  bucket_mask = count - 1;
+  clear();
+}
+
+void TranspositionTable::clear() {
+  if (!buckets.empty()) memset(&buckets[0], 0, buckets.size() * sizeof(TTBucket));
+  generation = 0;
+}
+
+bool TranspositionTable::probe(uint64_t key, TTEntry* entry) {
+  if (buckets.empty()) return false;
+  const TTBucket& bucket = bucketFor(key);
+  for (int i = 0; i < 4; ++i) {
+    load(&bucket.entries[i], entry);
+    if (entry->key == key && entry->bound != BOUND_NONE) return true;
+  }
+  return false;
+}
+
+void TranspositionTable::store(uint64_t key, int score, int depth, Bound bound,
+                               int move) {
+  if (buckets.empty()) return;
+  TTBucket& bucket = bucketFor(key);
+  uint8_t current = generation;
+  TTEntry* replace = &bucket.entries[0];
+  int replace_worth = INF;
+  for (int i = 0; i < 4; ++i) {
+    TTEntry entry;
+    load(&bucket.entries[i], &entry);
+    if (entry.key == key) {
+      replace = &bucket.entries[i];
+      break;
+    }
+    int worth = (entry.bound == BOUND_NONE) ? -INF :
+        entry.depth - 8 * (uint8_t)(current - entry.generation);
+    if (worth < replace_worth) {
+      replace = &bucket.entries[i];
+      replace_worth = worth;
+    }
+  }
+  TTEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.key = key;
+  entry.score = score;
+  entry.depth = depth;
+  entry.bound = bound;
+  entry.move = move;
+  entry.generation = current;
+  save(replace, entry);
+}
+
+int TranspositionTable::hashfull() {
+  int used = 0;
+  int sample = min((size_t)250, buckets.size());
+  for (int b = 0; b < sample; ++b) {
+    for (int i = 0; i < 4; ++i) {
+      TTEntry entry;
+      load(&buckets[b].entries[i], &entry);
+      used += entry.bound != BOUND_NONE && entry.generation == generation;
+    }
+  }
+  return (sample == 0) ? 0 : used * 1000 / (sample * 4);
+}
+
+// Budget for a single search. depth has the same meaning as the max_depth
+// argument of getMove(). A search with a time or node limit, or with
+// iterate set, deepens iteratively and keeps the last completed iteration
+// when it runs out of budget or is stopped.
+struct SearchLimits {
+  int depth;
+  long long time_ms;
+  long long nodes;
+  bool iterate;
+  // Setting *stop from another thread ends the search early.
+  const atomic<bool>* stop;
+  // While *ponder is set the search is pondering: it ignores its time and
+  // node limits. Clearing it is a ponder hit, from which the limits count.
+  const atomic<bool>* ponder;
+  // Root moves to report with their scores, best first; 1 reports only the
+  // best move.
+  int multipv;
+  // A line expected from this position, searched first by the first
+  // iteration, such as the rest of the last move's principal variation.
+  vector<int> pv;
+
+  SearchLimits()
+      : depth(25), time_ms(0), nodes(0), iterate(false), stop(NULL),
+        ponder(NULL), multipv(1) {}
+};
+
+// One of the best root moves of a multi-PV search. score is exact, or a
+// lower bound when the move unexpectedly beat the move ranked above it.
+// pv starts with the move.
+struct RootLine {
+  int move;
+  int score;
+  Bound bound;
+  vector<int> pv;
+};
+
+struct SearchResult {
+  int move;
+  // Score from the point of view of the side to move.
+  int score;
+  // Deepest max_depth that was searched to completion.
+  int depth;
+  long long nodes;
+  // The expected reply to move, or 0 if there is none.
+  int ponder;
+  // The principal variation, starting with move. It ends early where the
+  // search took a score from a table.
+  vector<int> pv;
+  // With multipv above 1, the best root moves, best first.
+  vector<RootLine> lines;
+};
+
+// Told about every completed iteration of an iterative search.
+class SearchListener {
+ public:
+  virtual void iterationDone(const SearchResult& result, long long time_ns) = 0;
+};
+
+// Anything that can choose moves, so that matches can pit different
+// kinds of engines against each other.
+class Engine {
+ public:
+  virtual ~Engine() {}
+  virtual int getMove(Board* board, char player, const SearchLimits& limits) = 0;
+};
+
+class Mirror : public Engine {
+ public:
+  int getMove(Board* board, char player, int max_depth);
+  int getMove(Board* board, char player, const SearchLimits& limits) {
+    return getMove(board, player, limits.depth);
+  }
 };
 
 int Mirror::getMove(Board* board, char player, int max_depth) {
-  this->board = board;
   int pp = (player == P1) ? board->p2 : board->p1;
+  if (pp == 0) return XY_TO_POS(2, 2);
   int px = POS_TO_X(pp);
   int py = POS_TO_Y(pp);
   int x = 4 - px;
@@ -129,12 +975,27 @@ int Mirror::getMove(Board* board, char player, int max_depth) {
 
 class Scorer {
  public:
+  virtual ~Scorer() {}
   virtual int getScore(Board* board, char player) = 0;
+  // Negamax calls these so that scorers can keep incremental state: with
+  // the board before each search, and as the player's token moves from
+  // `from` (0 for a placement) to `to` and back.
+  virtual void setPosition(Board* /*board*/) {}
+  virtual void makeMove(char /*player*/, int /*from*/, int /*to*/) {}
+  virtual void unmakeMove(char /*player*/, int /*from*/, int /*to*/) {}
+  // A scorer for another search to use at the same time. Scorers without
+  // incremental state are shared.
+  virtual Scorer* clone() { return this; }
 };
 
 class DijkstraScorer : public Scorer {
  public:
   int getScore(Board* board, char player);
+ protected:
+  // Breadth first search over queen moves from player's token. Counts the
+  // reachable cells (the token's own included), the sum of their move
+  // distances and the cells reachable in one move.
+  void explore(Board* board, char player, int* cells, int* steps, int* mobility);
  private:
   int dijkstra(Board* board, char player); 
 };
@@ -144,224 +1005,4689 @@ int DijkstraScorer::getScore(Board* board, char player) {
 }
 
 int DijkstraScorer::dijkstra(Board* board, char player) {
-  queue<int> q;
+  int total_cells, total_steps, mobility;
+  explore(board, player, &total_cells, &total_steps, &mobility);
+  return total_cells * SCORE_PER_CELL - total_steps; 
+}
+
+void DijkstraScorer::explore(Board* board, char player, int* cells, int* steps_sum,
+                             int* mobility) {
+  // Every cell is queued at most once.
+  int queue[25];
+  int head = 0;
+  int tail = 0;
   int steps[49];
   for (int i = 0; i < 49; ++i) steps[i] = -1;
 
   int total_cells = 0;
   int total_steps = 0;
+  int first_moves = 0;
   int pos = (player == P1) ? board->p1 : board->p2;
-  q.push(pos);
+  if (pos == 0) {
+    // A token that is not placed yet reaches every empty cell in one move.
+    int empty = board->emptyCells();
+    *cells = empty + 1;
+    *steps_sum = empty;
+    *mobility = empty;
+    return;
+  }
+  queue[tail++] = pos;
   steps[pos] = 0;
 
-  while (!q.empty()) { 
-    int pos = q.front(); q.pop();
+  while (head < tail) {
+    int pos = queue[head++];
     total_steps += steps[pos]; 
     total_cells += 1;
     int step = steps[pos] + 1;
+    // A ray passes over cells reached at this step, since cells beyond
+    // them may still be unreached, and ends at a cell reached no later
+    // than pos, whose own rays reach everything beyond it as early.
+    // generateMovesFrom() cannot end a ray early, so the rays are walked
+    // here.
     for (int i = 0; i < 8; ++i) {
-      int move = MOVES[i];
-      int p = pos;
-      while (true) {
-        p += move;
-        char& cell = board->board[p];
-        if (cell != EMPTY) {
-          break;
-        }
-        if (steps[p] != -1) {
-          break;
-        }
+      for (int p = pos + MOVES[i]; board->board[p] == EMPTY; p += MOVES[i]) {
+        if (steps[p] != -1 && steps[p] <= steps[pos]) break;
+        if (steps[p] == step) continue;
         steps[p] = step;
-        q.push(p);
+        queue[tail++] = p;
+        if (step == 1) first_moves++;
       }
     }
   }
 
-  return total_cells * SCORE_PER_CELL - total_steps; 
+  *cells = total_cells;
+  *steps_sum = total_steps;
+  *mobility = first_moves;
 }
 
-class Negamax {
- public:
-  Negamax();
-  Negamax(Scorer* scorer);
-  int getMove(Board* board, char player, int max_depth);
-  int depth_count;
+// Features of a position for WeightedScorer, from the point of view of a
+// player: explore() for the player and for the opponent.
+enum Feature {
+  OWN_CELLS, OWN_STEPS, OWN_MOBILITY, OPP_CELLS, OPP_STEPS, OPP_MOBILITY,
+  NUM_FEATURES
+};
+const char* FEATURE_NAMES[] = {
+  "own_cells", "own_steps", "own_mobility", "opp_cells", "opp_steps",
+  "opp_mobility"
+};
 
- private:
-  Board* board;
-  Scorer* scorer;
-  int max_depth;
+// A linear evaluation of the explore() features, with weights that can be
+// tuned from games and loaded from a file. The default weights give the
+// same scores as DijkstraScorer.
+class WeightedScorer : public DijkstraScorer {
+ public:
+  WeightedScorer();
+  int getScore(Board* board, char player);
+  void features(Board* board, char player, int* values);
+  // Weight files have one "<feature name> <weight>" line per feature.
+  bool load(const string& path);
+  bool save(const string& path);
 
-  int negamax(int ap_pos, int pp_pos, int depth, int alpha, int beta, int* best_move); 
-  void printDebug(int depth, const string& action, int score);
-  void printMove(int depth, int x, int y);
-  bool hasLost(int pos) {
-    return board->hasLost(pos);
-  }
+  double weights[NUM_FEATURES];
 };
 
-Negamax::Negamax() {
-  this->scorer = new DijkstraScorer();
+WeightedScorer::WeightedScorer() {
+  weights[OWN_CELLS] = SCORE_PER_CELL;
+  weights[OWN_STEPS] = -1;
+  weights[OWN_MOBILITY] = 0;
+  weights[OPP_CELLS] = -SCORE_PER_CELL;
+  weights[OPP_STEPS] = 1;
+  weights[OPP_MOBILITY] = 0;
 }
 
-Negamax::Negamax(Scorer* scorer) {
-  if (scorer == NULL) {
-    scorer = new DijkstraScorer();
-  }
-  this->scorer = scorer;
+void WeightedScorer::features(Board* board, char player, int* values) {
+  explore(board, player, &values[OWN_CELLS], &values[OWN_STEPS],
+          &values[OWN_MOBILITY]);
+  explore(board, OPPONENT(player), &values[OPP_CELLS], &values[OPP_STEPS],
+          &values[OPP_MOBILITY]);
 }
 
-int Negamax::getMove(Board* board, char player, int max_depth) {
-  this->board = board; 
-  this->max_depth = max_depth;
-  this->depth_count = 0;
-  int ap_pos = (player == P1) ? board->p1 : board->p2;
-  int pp_pos = (player == P1) ? board->p2 : board->p1;
-  int move = 0;
-  negamax(ap_pos, pp_pos, 1, -INF, INF, &move);
-  return move;
+int WeightedScorer::getScore(Board* board, char player) {
+  int values[NUM_FEATURES];
+  features(board, player, values);
+  double score = 0;
+  for (int i = 0; i < NUM_FEATURES; ++i) score += weights[i] * values[i];
+  // Heuristic scores must stay clear of win and loss scores.
+  score = min(max(score, -800.0), 800.0);
+  return (int)lround(score);
 }
 
-void Negamax::printDebug(int depth, const string& action, int score) {
-  for (int i = 0; i < depth; ++i) cout << "  ";
-  cout << depth << " " << action << " " << score << endl;
+bool WeightedScorer::load(const string& path) {
+  ifstream in(path.c_str());
+  string name;
+  double weight;
+  int found = 0;
+  while (in >> name >> weight) {
+    for (int i = 0; i < NUM_FEATURES; ++i) {
+      if (name == FEATURE_NAMES[i]) {
+        weights[i] = weight;
+        found++;
+      }
+    }
+  }
+  return in.eof() && found == NUM_FEATURES;
 }
 
-void Negamax::printMove(int depth, int x, int y) {
-  for (int i = 0; i < depth; ++i) cout << "  ";
-  cout << depth << " MOVE " << x << "," << y << endl;
+bool WeightedScorer::save(const string& path) {
+  ofstream out(path.c_str());
+  for (int i = 0; i < NUM_FEATURES; ++i) {
+    out << FEATURE_NAMES[i] << " " << weights[i] << "\n";
+  }
+  return out.good();
 }
 
-int Negamax::negamax(int ap_pos, int pp_pos, int depth, int alpha, int beta, int* best_move) {
-  if (hasLost(ap_pos)) {
-    DEBUG(printDebug(depth, "LOST", LOSS_VALUE + depth));
-    return LOSS_VALUE + depth;
-  }
+// Sizes of the NeuralScorer network. Its input features are, from the
+// point of view of one token, (token square, occupied cell) and (token
+// square, opponent token square) pairs, with square 25 for an unplaced
+// token. Both tokens share the feature weights.
+const int NN_TOKEN_SQUARES = 26;
+const int NN_FEATURES = NN_TOKEN_SQUARES * 50;
+const int NN_HIDDEN = 32;
+const int NN_L1 = 16;
+// Fixed point scales: 1.0 is NN_QA in the accumulator and activations,
+// and NN_QB (a power of two) in the layer weights.
+const int NN_QA = 127;
+const int NN_QB = 64;
+const int NN_QB_SHIFT = 6;
+// Score units per unit of network output.
+const int NN_OUTPUT_SCALE = 100;
 
-  char player = board->board[ap_pos];
-  if (depth == max_depth) {
-    depth_count++;
-    int score = scorer->getScore(board, player);
-    DEBUG(printDebug(depth, "SCORE", score));
-    return score;
+inline int nn_cell_feature(int token_sq, int sq) { return token_sq * 50 + sq; }
+inline int nn_token_feature(int token_sq, int sq) { return token_sq * 50 + 25 + sq; }
+
+// Fills features with the active features of a token and returns how many
+// there are, at most 26.
+int nn_active_features(uint32_t occupancy, int token, int opponent, uint16_t* features) {
+  int count = 0;
+  for (uint32_t bits = occupancy; bits != 0; bits &= bits - 1) {
+    features[count++] = nn_cell_feature(token, __builtin_ctz(bits));
   }
+  if (opponent != 25) features[count++] = nn_token_feature(token, opponent);
+  return count;
+}
 
-  int best_score = -INF;
-  char opponent = OPPONENT(player);
+// Quantized network weights. Weight files hold "ISNN", a version byte and
+// then this struct in native (little endian) byte order.
+struct NetworkWeights {
+  int16_t ft_weights[NN_FEATURES][NN_HIDDEN];
+  int16_t ft_bias[NN_HIDDEN];
+  // Inputs are the side to move's accumulator, then the opponent's.
+  int8_t l1_weights[NN_L1][2 * NN_HIDDEN];
+  int32_t l1_bias[NN_L1];
+  int8_t l2_weights[NN_L1];
+  int32_t l2_bias;
+};
 
-  for (int i = 0; i < 8; ++i) {
-    int pos = ap_pos;
-    int move = MOVES[i];
-    while (true) {
-      pos += move;
-      char& cell = board->board[pos];
-      if (cell != EMPTY) {
-        break;
+const char NETWORK_MAGIC[4] = {'I', 'S', 'N', 'N'};
+const unsigned char NETWORK_VERSION = 1;
+
+bool load_network(const string& path, NetworkWeights* weights) {
+  ifstream in(path.c_str(), ios::binary);
+  char header[5];
+  if (!in.read(header, 5) || memcmp(header, NETWORK_MAGIC, 4) != 0 ||
+      (unsigned char)header[4] != NETWORK_VERSION) {
+    return false;
+  }
+  in.read((char*)weights, sizeof(*weights));
+  return in.gcount() == sizeof(*weights) && in.peek() == EOF;
+}
+
+bool save_network(const string& path, const NetworkWeights& weights) {
+  ofstream out(path.c_str(), ios::binary);
+  out.write(NETWORK_MAGIC, 4);
+  out.put(NETWORK_VERSION);
+  out.write((const char*)&weights, sizeof(weights));
+  return out.good();
+}
+
+// Kernels of the network, NN_HIDDEN wide, with AVX2 versions where the
+// compiler targets it (-mavx2 or -march=native).
+#ifdef __AVX2__
+inline void nn_add(int16_t* acc, const int16_t* row) {
+  for (int i = 0; i < NN_HIDDEN; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(row + i));
+    _mm256_storeu_si256((__m256i*)(acc + i), _mm256_add_epi16(a, b));
+  }
+}
+
+inline void nn_sub(int16_t* acc, const int16_t* row) {
+  for (int i = 0; i < NN_HIDDEN; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(row + i));
+    _mm256_storeu_si256((__m256i*)(acc + i), _mm256_sub_epi16(a, b));
+  }
+}
+
+// Clamps the accumulator to [0, NN_QA] as bytes.
+inline void nn_clipped_relu(const int16_t* acc, uint8_t* out) {
+  for (int i = 0; i < NN_HIDDEN; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(acc + i + 16));
+    // packs works within 128 bit lanes, the permute restores the order.
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+    packed = _mm256_max_epi8(packed, _mm256_setzero_si256());
+    _mm256_storeu_si256((__m256i*)(out + i), packed);
+  }
+}
+
+// Dot product of 2 * NN_HIDDEN activations with a row of int8 weights.
+inline int32_t nn_dot(const uint8_t* in, const int8_t* weights) {
+  __m256i sum = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  for (int i = 0; i < 2 * NN_HIDDEN; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(in + i));
+    __m256i w = _mm256_loadu_si256((const __m256i*)(weights + i));
+    // Pairs of products stay below 2 * 127 * 128, so maddubs can't saturate.
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(a, w), ones));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+  return _mm_cvtsi128_si32(half);
+}
+#else
+inline void nn_add(int16_t* acc, const int16_t* row) {
+  for (int i = 0; i < NN_HIDDEN; ++i) acc[i] += row[i];
+}
+
+inline void nn_sub(int16_t* acc, const int16_t* row) {
+  for (int i = 0; i < NN_HIDDEN; ++i) acc[i] -= row[i];
+}
+
+inline void nn_clipped_relu(const int16_t* acc, uint8_t* out) {
+  for (int i = 0; i < NN_HIDDEN; ++i) out[i] = (uint8_t)min(max((int)acc[i], 0), NN_QA);
+}
+
+inline int32_t nn_dot(const uint8_t* in, const int8_t* weights) {
+  int32_t sum = 0;
+  for (int i = 0; i < 2 * NN_HIDDEN; ++i) sum += in[i] * weights[i];
+  return sum;
+}
+#endif
+
+// An NNUE style scorer: a small quantized network whose first layer is
+// kept per token as an accumulator, updated through the search hooks. A
+// move rebuilds the mover's accumulator, as the token square is part of
+// all its features, and changes three rows of the other one. getScore()
+// evaluates the position given to setPosition() and the moves since.
+class NeuralScorer : public Scorer {
+ public:
+  NeuralScorer();
+  bool load(const string& path);
+  // Random weights, for timing without a trained network.
+  void randomize(uint64_t seed);
+  int getScore(Board* board, char player);
+  void setPosition(Board* board);
+  void makeMove(char player, int from, int to);
+  void unmakeMove(char player, int from, int to);
+  // Clones share the weights and copy only the accumulators.
+  Scorer* clone() { return new NeuralScorer(*this); }
+  const NetworkWeights& getWeights() const { return *weights; }
+  void setWeights(const NetworkWeights& weights);
+
+ private:
+  struct State {
+    // Indexed by player - 1.
+    int16_t accumulator[2][NN_HIDDEN];
+    int token[2];
+    uint32_t occupancy;
+  };
+  // Never changed once set, so copies of a scorer share them.
+  shared_ptr<const NetworkWeights> weights;
+  State stack[64];
+  int ply;
+
+  void refresh(State* state, int side);
+};
+
+NeuralScorer::NeuralScorer() : weights(make_shared<NetworkWeights>()), ply(0) {
+  memset(stack, 0, sizeof(stack));
+}
+
+bool NeuralScorer::load(const string& path) {
+  shared_ptr<NetworkWeights> loaded = make_shared<NetworkWeights>();
+  if (!load_network(path, loaded.get())) return false;
+  weights = loaded;
+  return true;
+}
+
+void NeuralScorer::setWeights(const NetworkWeights& weights) {
+  this->weights = make_shared<NetworkWeights>(weights);
+}
+
+void NeuralScorer::randomize(uint64_t seed) {
+  shared_ptr<NetworkWeights> random = make_shared<NetworkWeights>();
+  NetworkWeights& weights = *random;
+  mt19937_64 rng(seed);
+  uniform_int_distribution<int> small(-32, 32);
+  for (int f = 0; f < NN_FEATURES; ++f) {
+    for (int i = 0; i < NN_HIDDEN; ++i) weights.ft_weights[f][i] = small(rng);
+  }
+  for (int i = 0; i < NN_HIDDEN; ++i) weights.ft_bias[i] = small(rng);
+  for (int j = 0; j < NN_L1; ++j) {
+    for (int i = 0; i < 2 * NN_HIDDEN; ++i) weights.l1_weights[j][i] = small(rng);
+    weights.l1_bias[j] = small(rng) * NN_QB;
+    weights.l2_weights[j] = small(rng);
+  }
+  weights.l2_bias = 0;
+  this->weights = random;
+}
+
+void NeuralScorer::refresh(State* state, int side) {
+  int16_t* acc = state->accumulator[side];
+  uint16_t features[26];
+  int count = nn_active_features(state->occupancy, state->token[side],
+                                 state->token[1 - side], features);
+  memcpy(acc, weights->ft_bias, sizeof(weights->ft_bias));
+  for (int i = 0; i < count; ++i) nn_add(acc, weights->ft_weights[features[i]]);
+}
+
+void NeuralScorer::setPosition(Board* board) {
+  State* state = &stack[0];
+  ply = 0;
+  state->occupancy = 0;
+  for (int sq = 0; sq < 25; ++sq) {
+    if (board->board[SQ_TO_POS(sq)] != EMPTY) state->occupancy |= 1U << sq;
+  }
+  state->token[0] = (board->p1 != 0) ? POS_TO_SQ(board->p1) : 25;
+  state->token[1] = (board->p2 != 0) ? POS_TO_SQ(board->p2) : 25;
+  refresh(state, 0);
+  refresh(state, 1);
+}
+
+void NeuralScorer::makeMove(char player, int from, int to) {
+  State* state = &stack[ply + 1];
+  *state = stack[ply];
+  ply++;
+  int side = player - 1;
+  int other = 1 - side;
+  int from_sq = (from != 0) ? POS_TO_SQ(from) : 25;
+  int to_sq = POS_TO_SQ(to);
+  state->occupancy |= 1U << to_sq;
+  state->token[side] = to_sq;
+  refresh(state, side);
+
+  int16_t* acc = state->accumulator[other];
+  int token = state->token[other];
+  nn_add(acc, weights->ft_weights[nn_cell_feature(token, to_sq)]);
+  if (from_sq != 25) nn_sub(acc, weights->ft_weights[nn_token_feature(token, from_sq)]);
+  nn_add(acc, weights->ft_weights[nn_token_feature(token, to_sq)]);
+}
+
+void NeuralScorer::unmakeMove(char /*player*/, int /*from*/, int /*to*/) {
+  ply--;
+}
+
+int NeuralScorer::getScore(Board* /*board*/, char player) {
+  const State& state = stack[ply];
+  uint8_t input[2 * NN_HIDDEN];
+  nn_clipped_relu(state.accumulator[player - 1], input);
+  nn_clipped_relu(state.accumulator[2 - player], input + NN_HIDDEN);
+  int32_t output = weights->l2_bias;
+  for (int j = 0; j < NN_L1; ++j) {
+    int32_t hidden = (nn_dot(input, weights->l1_weights[j]) + weights->l1_bias[j]) >> NN_QB_SHIFT;
+    output += min(max(hidden, 0), NN_QA) * weights->l2_weights[j];
+  }
+  int score = (int)((long long)output * NN_OUTPUT_SCALE / (NN_QA * NN_QB));
+  // Heuristic scores must stay clear of win and loss scores.
+  return min(max(score, -800), 800);
+}
+
+long long monotonic_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long long thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Positions with fewer plies than this left to search skip the analysis
+// cache, and results that took fewer nodes than this are not stored.
+const int CACHE_MIN_DEPTH = 4;
+const long long CACHE_MIN_NODES = 1000;
+
+// Optional search techniques of Negamax. They are all off by default, so
+// that the default search stays plain alpha-beta and bench keeps its
+// signature.
+struct SearchOptions {
+  // Late move reductions: at nodes with at least lmr_min_depth plies left,
+  // moves after the first lmr_full_moves (ordered by onward mobility) are
+  // searched with a null window, base + log(plies left) * log(move number)
+  // / divisor plies shallower, and again at full depth if they beat alpha.
+  bool lmr;
+  int lmr_min_depth;
+  int lmr_full_moves;
+  double lmr_base;
+  double lmr_divisor;
+  // Futility pruning: a node one ply above the horizon whose static score
+  // is at least futility_margin below alpha fails low without a search.
+  bool futility;
+  int futility_margin;
+  // Razoring: a node two plies above the horizon whose static score is at
+  // least razor_margin below alpha is first searched a ply shallower with
+  // a null window, and fails low if that does.
+  bool razoring;
+  int razor_margin;
+  // Size of the transposition table, 0 for none. The table orders the
+  // stored best move first and cuts off with stored scores.
+  int hash_mb;
+  // MTD(f): find the score of each iteration with null window searches
+  // converging from the previous score, rather than a full window search.
+  // It gets a 16 MB table if hash_mb is 0.
+  bool mtdf;
+  // Key the table by the packed position rather than a Zobrist key, so
+  // that a stored result is never used for another position.
+  bool packed_keys;
+
+  SearchOptions()
+      : lmr(false), lmr_min_depth(3), lmr_full_moves(3), lmr_base(0.75),
+        lmr_divisor(2.25), futility(false), futility_margin(3 * SCORE_PER_CELL),
+        razoring(false), razor_margin(6 * SCORE_PER_CELL), hash_mb(0),
+        mtdf(false), packed_keys(false) {}
+};
+
+// Sets a search option by the name of its field. Returns false if there
+// is no such option.
+bool set_search_option(const string& name, const string& value,
+                       SearchOptions* options) {
+  if (name == "lmr") {
+    options->lmr = atoi(value.c_str()) != 0;
+  } else if (name == "lmr_min_depth") {
+    options->lmr_min_depth = atoi(value.c_str());
+  } else if (name == "lmr_full_moves") {
+    options->lmr_full_moves = atoi(value.c_str());
+  } else if (name == "lmr_base") {
+    options->lmr_base = atof(value.c_str());
+  } else if (name == "lmr_divisor") {
+    options->lmr_divisor = atof(value.c_str());
+  } else if (name == "futility") {
+    options->futility = atoi(value.c_str()) != 0;
+  } else if (name == "futility_margin") {
+    options->futility_margin = atoi(value.c_str());
+  } else if (name == "razoring") {
+    options->razoring = atoi(value.c_str()) != 0;
+  } else if (name == "razor_margin") {
+    options->razor_margin = atoi(value.c_str());
+  } else if (name == "hash_mb") {
+    options->hash_mb = atoi(value.c_str());
+  } else if (name == "mtdf") {
+    options->mtdf = atoi(value.c_str()) != 0;
+  } else if (name == "packed_keys") {
+    options->packed_keys = atoi(value.c_str()) != 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+class SearchContext;
+
+class Negamax : public Engine {
+ public:
+  Negamax();
+  Negamax(Scorer* scorer);
+  ~Negamax();
+  // Searches may run on several threads at once, each in its own
+  // SearchContext. Options and the cache must not change meanwhile.
+  int getMove(Board* board, char player, int max_depth);
+  int getMove(Board* board, char player, const SearchLimits& limits,
+              SearchResult* result);
+  int getMove(Board* board, char player, const SearchLimits& limits) {
+    return getMove(board, player, limits, NULL);
+  }
+  // Makes searches use and add to a persistent analysis cache.
+  void setCache(AnalysisCache* cache) { this->cache = cache; }
+  void setListener(SearchListener* listener) { this->listener = listener; }
+  void setOptions(const SearchOptions& options);
+  // Counters of the last getMove() to finish.
+  int depth_count;
+  // Number of negamax() calls, leaves included.
+  long long node_count;
+  // Reduced searches, and how many of them had to be searched again at
+  // full depth.
+  long long lmr_reductions;
+  long long lmr_researches;
+  // Nodes cut by futility pruning and by razoring.
+  long long futility_prunes;
+  long long razor_prunes;
+  // Null window searches made by MTD(f).
+  long long mtdf_passes;
+
+ private:
+  friend class SearchContext;
+
+  // Searches clone it, so that scorers with incremental state get one
+  // each.
+  Scorer* scorer;
+  SearchOptions options;
+  // Reductions by plies left and move index.
+  unsigned char lmr_table[32][32];
+  // The transposition table, if options ask for one, shared by all
+  // searches.
+  TranspositionTable* table;
+  // Guards the counters.
+  mutex counters_lock;
+  AnalysisCache* cache;
+  SearchListener* listener;
+
+  void init(Scorer* scorer);
+  // Copies the counters of a finished search.
+  void finish(const SearchContext& context);
+};
+
+// The state of one search: its own copy of the board and of the scorer,
+// the counters, limits, principal variations and multi-PV exclusions.
+// Each getMove() makes one on its own thread. A search that needs a
+// table while the engine has none gets one of its own.
+class SearchContext {
+ public:
+  SearchContext(Negamax* engine, Board* board, char player, bool needs_table = false);
+  ~SearchContext();
+  // A fixed depth search, for Engine::getMove().
+  int searchDepth(int max_depth);
+  // The iterative search of Negamax::getMove().
+  int search(const SearchLimits& limits, SearchResult* result);
+
+ private:
+  friend class Negamax;
+
+  Negamax* engine;
+  const SearchOptions& options;
+  TranspositionTable* table;
+  // The table of this search alone, or NULL.
+  TranspositionTable* own_table;
+  AnalysisCache* cache;
+  Board position;
+  // Points at position, which the search plays moves on.
+  Board* board;
+  Scorer* scorer;
+  int depth_count;
+  long long node_count;
+  long long lmr_reductions;
+  long long lmr_researches;
+  long long futility_prunes;
+  long long razor_prunes;
+  long long mtdf_passes;
+  // The Zobrist key of the current node, if there is a table.
+  uint64_t hash;
+  // Plies cut from the current line by reductions; a node is a leaf once
+  // depth + reduced reaches max_depth.
+  int reduced;
+  int max_depth;
+  // A search stops once *stop is set, and a limited one also once
+  // monotonic_ns() passes the deadline or node_count reaches node_limit,
+  // if they are not 0 or NULL. While *ponder is set there is no deadline
+  // or node limit yet; they are set from the budgets when it is cleared.
+  bool limited;
+  long long deadline_ns;
+  long long node_limit;
+  const atomic<bool>* stop;
+  const atomic<bool>* ponder;
+  long long time_budget_ns;
+  long long node_budget;
+  bool aborted;
+  // Principal variations by depth: the best line found from the node at
+  // each depth is pv_table[depth][depth .. pv_length[depth]).
+  int pv_table[MAX_PLY + 1][MAX_PLY + 1];
+  int pv_length[MAX_PLY + 1];
+  // The principal variation of the last iteration, whose moves are searched
+  // first while follow_pv is set, that is down the leftmost path.
+  int pv_line[MAX_PLY];
+  int pv_count;
+  bool follow_pv;
+  // The side to move at the root; plies at odd depths are its moves.
+  char root_player;
+  // Root moves that the search skips, because multi-PV has already
+  // reported them.
+  int excluded[32];
+  int excluded_count;
+
+  bool outOfBudget();
+  void orderMoves(int* moves, int count);
+  // Searches the root with the selected driver, guess being the expected
+  // score for MTD(f).
+  int searchRoot(int ap_pos, int pp_pos, int guess, int* move, vector<int>* pv);
+  // The root's principal variation in pv_table.
+  vector<int> rootPv();
+  // Adds the next best root moves to the best one, up to count lines.
+  vector<RootLine> searchLines(int ap_pos, int pp_pos, int move, int score,
+                               const vector<int>& pv, int count);
+
+  int negamax(int ap_pos, int pp_pos, int depth, int alpha, int beta, int* best_move); 
+  void placements(int pp_pos, char player, MoveList& list);
+  PackedPosition packNode(int ap_pos, int pp_pos, char player);
+  void printDebug(int depth, const string& action, int score);
+  void printMove(int depth, int x, int y);
+  bool hasLost(int pos) {
+    return board->hasLost(pos);
+  }
+};
+
+Negamax::Negamax() {
+  init(new DijkstraScorer());
+}
+
+Negamax::Negamax(Scorer* scorer) {
+  if (scorer == NULL) {
+    scorer = new DijkstraScorer();
+  }
+  init(scorer);
+}
+
+Negamax::~Negamax() {
+  delete table;
+}
+
+void Negamax::init(Scorer* scorer) {
+  this->scorer = scorer;
+  this->table = NULL;
+  this->cache = NULL;
+  this->listener = NULL;
+  this->depth_count = 0;
+  this->node_count = 0;
+  this->lmr_reductions = 0;
+  this->lmr_researches = 0;
+  this->futility_prunes = 0;
+  this->razor_prunes = 0;
+  this->mtdf_passes = 0;
+  setOptions(SearchOptions());
+}
+
+void Negamax::finish(const SearchContext& context) {
+  lock_guard<mutex> lock(counters_lock);
+  depth_count = context.depth_count;
+  node_count = context.node_count;
+  lmr_reductions = context.lmr_reductions;
+  lmr_researches = context.lmr_researches;
+  futility_prunes = context.futility_prunes;
+  razor_prunes = context.razor_prunes;
+  mtdf_passes = context.mtdf_passes;
+}
+
+int Negamax::getMove(Board* board, char player, int max_depth) {
+  SearchContext context(this, board, player);
+  int move = context.searchDepth(max_depth);
+  finish(context);
+  return move;
+}
+
+int Negamax::getMove(Board* board, char player, const SearchLimits& limits,
+                     SearchResult* result) {
+  // The further lines of multi-PV lean on a table, as MTD(f) does.
+  SearchContext context(this, board, player, limits.multipv > 1);
+  int move = context.search(limits, result);
+  finish(context);
+  return move;
+}
+
+SearchContext::SearchContext(Negamax* engine, Board* board, char player,
+                             bool needs_table)
+    : engine(engine), options(engine->options), table(engine->table),
+      own_table(NULL), cache(engine->cache),
+      position(*board), board(&position), depth_count(0), node_count(0),
+      lmr_reductions(0), lmr_researches(0), futility_prunes(0), razor_prunes(0),
+      mtdf_passes(0), hash(0), reduced(0), max_depth(0), limited(false),
+      deadline_ns(0), node_limit(0), stop(NULL), ponder(NULL), time_budget_ns(0),
+      node_budget(0), aborted(false), pv_count(0), follow_pv(false),
+      root_player(player), excluded_count(0) {
+  if (needs_table && table == NULL) {
+    own_table = new TranspositionTable(options.packed_keys);
+    own_table->resize(16);
+    table = own_table;
+  }
+  scorer = engine->scorer->clone();
+  scorer->setPosition(this->board);
+  if (table != NULL) {
+    table->newSearch();
+    hash = options.packed_keys ? pack_position(position, player) :
+        zobrist_key(*board, player);
+  }
+}
+
+SearchContext::~SearchContext() {
+  if (scorer != engine->scorer) delete scorer;
+  delete own_table;
+}
+
+void Negamax::setOptions(const SearchOptions& options) {
+  this->options = options;
+  int hash_mb = (options.mtdf && options.hash_mb == 0) ? 16 : options.hash_mb;
+  delete table;
+  table = NULL;
+  if (hash_mb > 0) {
+    table = new TranspositionTable(options.packed_keys);
+    table->resize(hash_mb);
+  }
+  for (int depth = 0; depth < 32; ++depth) {
+    for (int index = 0; index < 32; ++index) {
+      double r = (depth == 0 || index == 0) ? 0 : options.lmr_base +
+          log((double)depth) * log((double)index + 1) / options.lmr_divisor;
+      lmr_table[depth][index] = (unsigned char)max(0, (int)r);
+    }
+  }
+}
+
+// Sorts moves by the number of empty cells around them, most first.
+void SearchContext::orderMoves(int* moves, int count) {
+  int keys[32];
+  for (int i = 0; i < count; ++i) {
+    keys[i] = 0;
+    for (int d = 0; d < 8; ++d) keys[i] += board->board[moves[i] + MOVES[d]] == EMPTY;
+  }
+  for (int i = 1; i < count; ++i) {
+    int move = moves[i], key = keys[i], j = i;
+    for (; j > 0 && keys[j - 1] < key; --j) {
+      moves[j] = moves[j - 1];
+      keys[j] = keys[j - 1];
+    }
+    moves[j] = move;
+    keys[j] = key;
+  }
+}
+
+int SearchContext::searchDepth(int max_depth) {
+  this->max_depth = max_depth;
+  int ap_pos = (root_player == P1) ? board->p1 : board->p2;
+  int pp_pos = (root_player == P1) ? board->p2 : board->p1;
+  int move = 0;
+  vector<int> pv;
+  searchRoot(ap_pos, pp_pos, 0, &move, &pv);
+  return move;
+}
+
+int SearchContext::searchRoot(int ap_pos, int pp_pos, int guess, int* move, vector<int>* pv) {
+  if (!options.mtdf) {
+    follow_pv = pv_count > 0;
+    int score = negamax(ap_pos, pp_pos, 1, -INF, INF, move);
+    *pv = rootPv();
+    return score;
+  }
+  // Each null window search fails high or low, raising the lower bound or
+  // lowering the upper one, until they meet. The best move is the one
+  // that last failed high.
+  int lower = -INF;
+  int upper = INF;
+  int score = guess;
+  while (lower < upper) {
+    int beta = (score == lower) ? score + 1 : score;
+    int pass_move = 0;
+    follow_pv = pv_count > 0;
+    score = negamax(ap_pos, pp_pos, 1, beta - 1, beta, &pass_move);
+    mtdf_passes++;
+    if (aborted) return 0;
+    if (score < beta) {
+      upper = score;
+    } else {
+      lower = score;
+      *move = pass_move;
+      *pv = rootPv();
+    }
+  }
+  return score;
+}
+
+vector<int> SearchContext::rootPv() {
+  return vector<int>(pv_table[1] + 1, pv_table[1] + pv_length[1]);
+}
+
+// Each further line comes from a search of the root without the moves
+// already found, whose beta is just above the score of the line before:
+// the next best move can't score more, and the table keeps most of the
+// tree from the earlier searches.
+vector<RootLine> SearchContext::searchLines(int ap_pos, int pp_pos, int move,
+                                            int score, const vector<int>& pv, int count) {
+  vector<RootLine> lines;
+  // A lost root has no lines.
+  if (move == 0) return lines;
+  RootLine line = {move, score, BOUND_EXACT, pv};
+  lines.push_back(line);
+  excluded_count = 0;
+  while ((int)lines.size() < count) {
+    excluded[excluded_count++] = lines.back().move;
+    int beta = lines.back().score + 1;
+    line.move = 0;
+    follow_pv = false;
+    line.score = negamax(ap_pos, pp_pos, 1, -INF, beta, &line.move);
+    if (aborted || line.move == 0) break;
+    line.bound = (line.score >= beta) ? BOUND_LOWER : BOUND_EXACT;
+    line.pv = rootPv();
+    lines.push_back(line);
+  }
+  excluded_count = 0;
+  return lines;
+}
+
+int SearchContext::search(const SearchLimits& limits, SearchResult* result) {
+  char player = root_player;
+  int ap_pos = (player == P1) ? board->p1 : board->p2;
+  int pp_pos = (player == P1) ? board->p2 : board->p1;
+  SearchResult best = SearchResult();
+  long long start = monotonic_ns();
+
+  // Searching deeper than the number of empty cells changes nothing.
+  int last_depth = min(limits.depth, board->emptyCells() + 1);
+  bool iterate = limits.iterate || limits.time_ms > 0 || limits.nodes > 0;
+  int first_depth = iterate ? min(2, last_depth) : last_depth;
+  this->stop = limits.stop;
+  this->ponder = (limits.ponder != NULL && *limits.ponder) ? limits.ponder : NULL;
+  this->time_budget_ns = limits.time_ms * 1000000LL;
+  this->node_budget = limits.nodes;
+  this->deadline_ns = (time_budget_ns > 0 && ponder == NULL) ?
+      start + time_budget_ns : 0;
+  this->node_limit = (ponder == NULL) ? node_budget : 0;
+  this->pv_count = min((int)limits.pv.size(), MAX_PLY);
+  copy(limits.pv.begin(), limits.pv.begin() + pv_count, pv_line);
+
+  for (int depth = first_depth; depth <= last_depth; ++depth) {
+    this->max_depth = depth;
+    // The limits don't apply to the first iteration, so that there is a
+    // move, but a stop does; see below.
+    this->limited = depth > first_depth;
+    this->aborted = stop != NULL && *stop;
+    int move = 0;
+    vector<int> pv;
+    int score = aborted ? 0 : searchRoot(ap_pos, pp_pos, best.score, &move, &pv);
+    vector<RootLine> lines;
+    if (!aborted && limits.multipv > 1) {
+      lines = searchLines(ap_pos, pp_pos, move, score, pv, limits.multipv);
+    }
+    if (aborted) break;
+    best.move = move;
+    best.score = score;
+    best.depth = depth;
+    best.nodes = node_count;
+    best.ponder = (pv.size() > 1) ? pv[1] : 0;
+    best.pv = pv;
+    best.lines = lines;
+    pv_count = min((int)pv.size(), MAX_PLY);
+    copy(pv.begin(), pv.begin() + pv_count, pv_line);
+    if (engine->listener != NULL) {
+      engine->listener->iterationDone(best, monotonic_ns() - start);
+    }
+  }
+  if (best.move == 0) {
+    // Stopped before the first iteration finished: any legal move keeps
+    // the bestmove promise.
+    for (int sq = 0; sq < 25 && best.move == 0; ++sq) {
+      if (board->canMove(player, SQ_TO_POS(sq))) best.move = SQ_TO_POS(sq);
+    }
+  }
+  best.nodes = node_count;
+  if (result != NULL) *result = best;
+  return best.move;
+}
+
+bool SearchContext::outOfBudget() {
+  if (stop != NULL && *stop) return true;
+  if (!limited) return false;
+  if (ponder != NULL && !*ponder) {
+    // A ponder hit: the budgets start counting now.
+    ponder = NULL;
+    if (time_budget_ns > 0) deadline_ns = monotonic_ns() + time_budget_ns;
+    if (node_budget > 0) node_limit = node_count + node_budget;
+  }
+  return deadline_ns != 0 && monotonic_ns() >= deadline_ns;
+}
+
+void SearchContext::printDebug(int depth, const string& action, int score) {
+  for (int i = 0; i < depth; ++i) cerr << "  ";
+  cerr << depth << " " << action << " " << score << endl;
+}
+
+void SearchContext::printMove(int depth, int x, int y) {
+  for (int i = 0; i < depth; ++i) cerr << "  ";
+  cerr << depth << " MOVE " << x << "," << y << endl;
+}
+
+int SearchContext::negamax(int ap_pos, int pp_pos, int depth, int alpha, int beta, int* best_move) {
+  node_count++;
+  if (((node_count & 1023) == 0 && outOfBudget()) ||
+      (limited && node_limit != 0 && node_count >= node_limit)) {
+    aborted = true;
+  }
+  pv_length[depth] = depth;
+  if (aborted) return 0;
+
+  if (hasLost(ap_pos)) {
+    DEBUG(printDebug(depth, "LOST", LOSS_VALUE + depth));
+    return LOSS_VALUE + depth;
+  }
+
+  // A token that is not placed yet has no cell to tell whose turn it is.
+  char player = (ap_pos != 0) ? board->board[ap_pos] :
+      (depth % 2 == 1) ? root_player : OPPONENT(root_player);
+  if (depth + reduced >= max_depth) {
+    depth_count++;
+    int score = scorer->getScore(board, player);
+    DEBUG(printDebug(depth, "SCORE", score));
+    return score;
+  }
+
+  // Only positions with enough depth left are worth a cache lookup, and
+  // only results that took enough nodes are worth keeping.
+  int remaining = max_depth - depth - reduced;
+  PackedPosition key = 0;
+  int transform = 0;
+  long long start_nodes = node_count;
+  int alpha_orig = alpha;
+  // A root that skips moves has no result of its own to look up or keep.
+  bool excluding = depth == 1 && excluded_count > 0;
+  if (cache != NULL && remaining >= CACHE_MIN_DEPTH && !excluding) {
+    key = canonical_position(packNode(ap_pos, pp_pos, player), &transform);
+    CacheEntry entry;
+    if (cache->probe(key, &entry) && entry.depth >= remaining) {
+      int score = score_from_stored(entry.score, depth);
+      int move = (entry.move == NO_SQUARE) ? 0 :
+          SQ_TO_POS(INVERSE_SYMMETRY[transform][entry.move]);
+      bool usable = entry.bound == BOUND_EXACT ||
+          (entry.bound == BOUND_LOWER && score >= beta) ||
+          (entry.bound == BOUND_UPPER && score <= alpha);
+      if (usable && best_move == NULL) return score;
+      if (usable && move != 0) {
+        *best_move = move;
+        pv_table[depth][depth] = move;
+        pv_length[depth] = depth + 1;
+        return score;
+      }
+    }
+  }
+
+  int hash_move = 0;
+  if (table != NULL) {
+    TTEntry entry;
+    if (table->probe(hash, &entry)) {
+      hash_move = (entry.move == NO_SQUARE) ? 0 : SQ_TO_POS(entry.move);
+      int score = score_from_stored(entry.score, depth);
+      // The root always searches, so that it has a best move and reply.
+      if (depth > 1 && entry.depth >= remaining &&
+          (entry.bound == BOUND_EXACT ||
+           (entry.bound == BOUND_LOWER && score >= beta) ||
+           (entry.bound == BOUND_UPPER && score <= alpha))) {
+        if (hash_move != 0) {
+          pv_table[depth][depth] = hash_move;
+          pv_length[depth] = depth + 1;
+        }
+        return score;
+      }
+    }
+  }
+
+  // Near the horizon, a static score far below alpha is unlikely to be
+  // caught up by the few plies left. Mate scores are never pruned.
+  if (depth > 1 && remaining <= 2 && (options.futility || options.razoring) &&
+      alpha > -WIN_THRESHOLD && beta < WIN_THRESHOLD) {
+    int static_score = scorer->getScore(board, player);
+    if (options.futility && remaining == 1 &&
+        static_score + options.futility_margin <= alpha) {
+      futility_prunes++;
+      return static_score;
+    }
+    if (options.razoring && remaining == 2 &&
+        static_score + options.razor_margin <= alpha) {
+      reduced++;
+      int score = negamax(ap_pos, pp_pos, depth, alpha, alpha + 1, NULL);
+      reduced--;
+      if (aborted) return 0;
+      if (score <= alpha) {
+        razor_prunes++;
+        return score;
+      }
+    }
+  }
+
+  // The previous principal variation goes first, while this node is on it.
+  int pv_move = (follow_pv && depth <= pv_count) ? pv_line[depth - 1] : 0;
+  follow_pv = pv_move != 0;
+
+  int best_score = -INF;
+  int node_best = 0;
+
+  MoveList list;
+  board->generateMoves(player, list);
+  if (ap_pos == 0) placements(pp_pos, player, list);
+  int* moves = list.moves;
+  int count = list.count;
+  if (excluding) {
+    int kept = 0;
+    for (int m = 0; m < count; ++m) {
+      if (find(excluded, excluded + excluded_count, moves[m]) == excluded + excluded_count) {
+        moves[kept++] = moves[m];
+      }
+    }
+    count = kept;
+  }
+  bool reduce = options.lmr && remaining >= options.lmr_min_depth;
+  if (reduce) orderMoves(moves, count);
+  for (int m = 1; m < count && hash_move != 0; ++m) {
+    if (moves[m] == hash_move) {
+      rotate(moves, moves + m, moves + m + 1);
+      break;
+    }
+  }
+  if (pv_move != 0) {
+    int* found = find(moves, moves + count, pv_move);
+    if (found != moves + count) {
+      rotate(moves, found, found + 1);
+    } else {
+      follow_pv = false;
+    }
+  }
+  uint64_t node_hash = hash;
+  int from_sq = (ap_pos != 0) ? POS_TO_SQ(ap_pos) : 25;
+  int from_packed = (ap_pos != 0) ? from_sq : NO_SQUARE;
+
+  for (int m = 0; m < count; ++m) {
+    int pos = moves[m];
+    DEBUG(printMove(depth, POS_TO_X(pos), POS_TO_Y(pos)));
+    board->makeMove(player, pos);
+    scorer->makeMove(player, ap_pos, pos);
+    if (table != NULL) {
+      int to_sq = POS_TO_SQ(pos);
+      hash = options.packed_keys ? packed_move(node_hash, player, from_packed, to_sq) :
+          node_hash ^ ZOBRIST_CELL[to_sq] ^ ZOBRIST_SIDE ^
+          ZOBRIST_TOKEN[player - 1][from_sq] ^ ZOBRIST_TOKEN[player - 1][to_sq];
+    }
+    // The root's children come back with a move, as the root does.
+    int reply = 0;
+    int* reply_move = (depth == 1) ? &reply : NULL;
+    int r = (reduce && m >= options.lmr_full_moves) ?
+        min((int)engine->lmr_table[min(remaining, 31)][min(m, 31)], remaining - 1) : 0;
+    int score;
+    if (r > 0) {
+      lmr_reductions++;
+      reduced += r;
+      score = -1 * negamax(pp_pos, pos, depth+1, -alpha-1, -alpha, reply_move);
+      reduced -= r;
+      if (score > alpha && !aborted) {
+        lmr_researches++;
+        score = -1 * negamax(pp_pos, pos, depth+1, -beta, -alpha, reply_move);
+      }
+    } else {
+      score = -1 * negamax(pp_pos, pos, depth+1, -beta, -alpha, reply_move);
+    }
+    scorer->unmakeMove(player, ap_pos, pos);
+    board->unmakeMove(player, pos, ap_pos);
+    hash = node_hash;
+    follow_pv = false;
+    if (aborted) return 0;
+    if (score > best_score) {
+      best_score = score;
+      node_best = pos;
+      if (best_move != NULL) {
+          *best_move = pos;
+      }
+      pv_table[depth][depth] = pos;
+      memcpy(pv_table[depth] + depth + 1, pv_table[depth + 1] + depth + 1,
+             (pv_length[depth + 1] - depth - 1) * sizeof(int));
+      pv_length[depth] = pv_length[depth + 1];
+    }
+    alpha = (alpha >= score) ? alpha : score;
+    if (alpha >= beta) break;
+  }
+  DEBUG(printDebug(depth, "BEST", best_score));
+
+  if (table != NULL && !excluding) {
+    Bound bound = (best_score <= alpha_orig) ? BOUND_UPPER :
+        (best_score >= beta) ? BOUND_LOWER : BOUND_EXACT;
+    table->store(node_hash, score_to_stored(best_score, depth), remaining, bound,
+                 POS_TO_SQ(node_best));
+  }
+
+  if (key != 0 && node_count - start_nodes >= CACHE_MIN_NODES) {
+    CacheEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = key;
+    entry.score = score_to_stored(best_score, depth);
+    entry.depth = remaining;
+    entry.bound = (best_score <= alpha_orig) ? BOUND_UPPER :
+        (best_score >= beta) ? BOUND_LOWER : BOUND_EXACT;
+    entry.move = SYMMETRY[transform][POS_TO_SQ(node_best)];
+    cache->store(entry);
+  }
+  return best_score;
+}
+
+// Drops the placements of player's token that give the same position as
+// an earlier one under a symmetry of the board.
+void SearchContext::placements(int pp_pos, char player, MoveList& list) {
+  PackedPosition node = packNode(0, pp_pos, player);
+  int shift = (player == P1) ? 25 : 30;
+  PackedPosition seen[MAX_MOVES];
+  int count = 0;
+  for (int m = 0; m < list.count; ++m) {
+    int pos = list.moves[m];
+    int sq = POS_TO_SQ(pos);
+    PackedPosition child = (node & ~(31ULL << shift)) | (1ULL << sq) |
+        ((PackedPosition)sq << shift);
+    int transform;
+    PackedPosition canonical = canonical_position(child, &transform);
+    if (find(seen, seen + count, canonical) != seen + count) continue;
+    seen[count] = canonical;
+    list.moves[count++] = pos;
+  }
+  list.count = count;
+}
+
+PackedPosition SearchContext::packNode(int ap_pos, int pp_pos, char player) {
+  PackedPosition packed = 0;
+  for (int sq = 0; sq < 25; ++sq) {
+    if (board->board[SQ_TO_POS(sq)] != EMPTY) packed |= 1ULL << sq;
+  }
+  int p1 = (player == P1) ? ap_pos : pp_pos;
+  int p2 = (player == P1) ? pp_pos : ap_pos;
+  packed |= (PackedPosition)(p1 ? POS_TO_SQ(p1) : NO_SQUARE) << 25;
+  packed |= (PackedPosition)(p2 ? POS_TO_SQ(p2) : NO_SQUARE) << 30;
+  if (player == P2) packed |= 1ULL << 35;
+  return packed;
+}
+
+// Squares along each queen direction from each square, for the bitboard
+// move generation of MCTS playouts. Rays end with -1.
+int RAY_SQUARES[25][8][5];
+
+bool fill_rays() {
+  const int dx[] = {0, 0, 1, -1, 1, -1, 1, -1};
+  const int dy[] = {1, -1, 0, 0, -1, 1, 1, -1};
+  for (int sq = 0; sq < 25; ++sq) {
+    for (int d = 0; d < 8; ++d) {
+      int x = sq / 5 + dx[d], y = sq % 5 + dy[d], k = 0;
+      for (; x >= 0 && x < 5 && y >= 0 && y < 5; x += dx[d], y += dy[d]) {
+        RAY_SQUARES[sq][d][k++] = x * 5 + y;
+      }
+      RAY_SQUARES[sq][d][k] = -1;
+    }
+  }
+  return true;
+}
+
+// Filled by the first engine constructed; the static's initialization is
+// safe when match workers construct engines on several threads.
+void init_rays() {
+  static bool done = fill_rays();
+  (void)done;
+}
+
+// A position as bitboards: the 25 bit occupancy and the token squares,
+// 25 for an unplaced token.
+struct BitPosition {
+  uint32_t occupancy;
+  int token[2];
+  char player;
+
+  // Fills moves with squares and returns how many there are.
+  int moves(int* out) const {
+    int count = 0;
+    int from = token[player - 1];
+    if (from == 25) {
+      for (uint32_t empty = ~occupancy & 0x1FFFFFF; empty != 0; empty &= empty - 1) {
+        out[count++] = __builtin_ctz(empty);
+      }
+      return count;
+    }
+    for (int d = 0; d < 8; ++d) {
+      for (const int* sq = RAY_SQUARES[from][d]; *sq >= 0 && !(occupancy >> *sq & 1); ++sq) {
+        out[count++] = *sq;
+      }
+    }
+    return count;
+  }
+
+  void play(int sq) {
+    occupancy |= 1U << sq;
+    token[player - 1] = sq;
+    player = OPPONENT(player);
+  }
+};
+
+// Options of MctsEngine: search threads, the UCT exploration constant, the
+// arena size in nodes, the playouts of a search without other limits, and
+// whether playouts prefer moves with more onward moves.
+struct MctsOptions {
+  int threads;
+  double exploration;
+  int arena_nodes;
+  long long playouts;
+  bool guided;
+
+  MctsOptions()
+      : threads(1), exploration(1.0), arena_nodes(1 << 20), playouts(20000),
+        guided(false) {}
+};
+
+bool set_mcts_option(const string& name, const string& value, MctsOptions* options) {
+  if (name == "threads") {
+    options->threads = max(1, atoi(value.c_str()));
+  } else if (name == "c") {
+    options->exploration = atof(value.c_str());
+  } else if (name == "arena") {
+    options->arena_nodes = max(2, atoi(value.c_str()));
+  } else if (name == "playouts") {
+    options->playouts = atoll(value.c_str());
+  } else if (name == "guided") {
+    options->guided = atoi(value.c_str()) != 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Monte Carlo tree search with UCT selection and random (or guided)
+// bitboard playouts. Nodes live in an arena allocated once, children of
+// a node next to each other, and the tree is shared by all threads: a
+// visit is counted on the way down, which is the virtual loss that keeps
+// threads apart until the playout result is added on the way back up.
+// With limits, nodes counts playouts; depth is ignored.
+class MctsEngine : public Engine {
+ public:
+  MctsEngine(const MctsOptions& options);
+  int getMove(Board* board, char player, const SearchLimits& limits);
+  // Playouts and tree nodes of the last search.
+  long long playout_count;
+  long long tree_size;
+
+ private:
+  enum { UNEXPANDED, EXPANDING, EXPANDED };
+  struct Node {
+    // Visits, and wins of the player who moved into the node.
+    atomic<uint32_t> visits;
+    atomic<uint32_t> wins;
+    atomic<uint8_t> state;
+    uint8_t move;
+    uint8_t child_count;
+    uint32_t first_child;
+  };
+
+  MctsOptions options;
+  vector<Node> arena;
+  atomic<uint32_t> arena_used;
+  atomic<long long> playouts;
+  BitPosition root;
+  mutex search_lock;
+
+  void worker(int index, long long budget, long long deadline_ns,
+              const atomic<bool>* stop);
+  void iterate(mt19937_64& rng);
+  void expand(Node* node, const BitPosition& position);
+  Node* select(Node* node);
+  char playout(BitPosition position, mt19937_64& rng);
+  Node* bestChild(Node* node);
+};
+
+MctsEngine::MctsEngine(const MctsOptions& options)
+    : playout_count(0), tree_size(0), options(options), arena(options.arena_nodes),
+      arena_used(0), playouts(0) {
+  init_rays();
+}
+
+int MctsEngine::getMove(Board* board, char player, const SearchLimits& limits) {
+  // The arena holds one tree, so concurrent calls take turns.
+  lock_guard<mutex> lock(search_lock);
+  root.occupancy = 0;
+  for (int sq = 0; sq < 25; ++sq) {
+    if (board->board[SQ_TO_POS(sq)] != EMPTY) root.occupancy |= 1U << sq;
+  }
+  root.token[0] = (board->p1 != 0) ? POS_TO_SQ(board->p1) : 25;
+  root.token[1] = (board->p2 != 0) ? POS_TO_SQ(board->p2) : 25;
+  root.player = player;
+
+  Node& top = arena[0];
+  top.visits = 0;
+  top.wins = 0;
+  top.state = UNEXPANDED;
+  top.move = 25;
+  top.child_count = 0;
+  arena_used = 1;
+  playouts = 0;
+  expand(&top, root);
+  if (top.child_count == 0) return 0;
+
+  long long budget = limits.nodes;
+  long long deadline_ns = (limits.time_ms > 0) ?
+      monotonic_ns() + limits.time_ms * 1000000LL : 0;
+  if (budget == 0 && deadline_ns == 0) budget = options.playouts;
+  vector<thread> workers;
+  for (int t = 1; t < options.threads; ++t) {
+    workers.push_back(thread(&MctsEngine::worker, this, t, budget, deadline_ns,
+                             limits.stop));
+  }
+  worker(0, budget, deadline_ns, limits.stop);
+  for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+
+  playout_count = playouts;
+  tree_size = arena_used;
+  return SQ_TO_POS(bestChild(&top)->move);
+}
+
+void MctsEngine::worker(int index, long long budget, long long deadline_ns,
+                        const atomic<bool>* stop) {
+  mt19937_64 rng(index * 0x9E3779B97F4A7C15ULL + root.occupancy);
+  for (long long i = 0; ; ++i) {
+    if (budget > 0 && playouts.fetch_add(1) >= budget) break;
+    if (budget == 0) playouts++;
+    // Every playout may be the last one in time, but the clock is slow.
+    if ((i & 63) == 0 && ((deadline_ns != 0 && monotonic_ns() >= deadline_ns) ||
+                          (stop != NULL && *stop))) {
+      break;
+    }
+    iterate(rng);
+  }
+}
+
+void MctsEngine::iterate(mt19937_64& rng) {
+  Node* path[32];
+  int length = 0;
+  BitPosition position = root;
+  Node* node = &arena[0];
+  node->visits++;
+  path[length++] = node;
+  while (node->state == EXPANDED && node->child_count > 0) {
+    node = select(node);
+    node->visits++;
+    position.play(node->move);
+    path[length++] = node;
+  }
+  if (node->state == UNEXPANDED && node->visits > 1) {
+    expand(node, position);
+  }
+  char winner = playout(position, rng);
+  // Nodes at odd plies were moved into by the root player.
+  for (int i = 0; i < length; ++i) {
+    char mover = (i % 2 == 1) ? root.player : OPPONENT(root.player);
+    if (winner == mover) path[i]->wins++;
+  }
+}
+
+void MctsEngine::expand(Node* node, const BitPosition& position) {
+  uint8_t expected = UNEXPANDED;
+  if (!node->state.compare_exchange_strong(expected, EXPANDING)) return;
+  int moves[32];
+  int count = position.moves(moves);
+  // Claims the children's slots only if they fit, so that a full arena
+  // leaves the counter at the tree size.
+  uint32_t first = arena_used;
+  do {
+    if (first + count > arena.size()) {
+      // The arena is full: the node stays a leaf.
+      node->state = UNEXPANDED;
+      return;
+    }
+  } while (!arena_used.compare_exchange_weak(first, first + count));
+  for (int i = 0; i < count; ++i) {
+    Node& child = arena[first + i];
+    child.visits = 0;
+    child.wins = 0;
+    child.state = UNEXPANDED;
+    child.move = moves[i];
+    child.child_count = 0;
+  }
+  node->first_child = first;
+  node->child_count = count;
+  node->state = EXPANDED;
+}
+
+MctsEngine::Node* MctsEngine::select(Node* node) {
+  double log_visits = log((double)max(1U, node->visits.load()));
+  Node* best = NULL;
+  double best_value = -1;
+  for (int i = 0; i < node->child_count; ++i) {
+    Node* child = &arena[node->first_child + i];
+    uint32_t visits = child->visits;
+    if (visits == 0) return child;
+    double value = (double)child->wins / visits +
+        options.exploration * sqrt(log_visits / visits);
+    if (value > best_value) {
+      best_value = value;
+      best = child;
+    }
+  }
+  return best;
+}
+
+char MctsEngine::playout(BitPosition position, mt19937_64& rng) {
+  int moves[32];
+  while (true) {
+    int count = position.moves(moves);
+    if (count == 0) return OPPONENT(position.player);
+    int move = moves[rng() % count];
+    if (options.guided && count > 1) {
+      // The better of two random moves by onward moves.
+      int other = moves[rng() % count];
+      int onward[32];
+      BitPosition a = position, b = position;
+      a.play(move);
+      b.play(other);
+      a.player = b.player = position.player;
+      if (b.moves(onward) > a.moves(onward)) move = other;
+    }
+    position.play(move);
+  }
+}
+
+MctsEngine::Node* MctsEngine::bestChild(Node* node) {
+  Node* best = &arena[node->first_child];
+  for (int i = 1; i < node->child_count; ++i) {
+    Node* child = &arena[node->first_child + i];
+    if (child->visits > best->visits) best = child;
+  }
+  return best;
+}
+
+void Board::printPossibleMoves(char player, ostream& out) {
+  char brd[49];
+  for (int i = 0; i < 49; ++i) {
+    brd[i] = board[i];
+  }
+
+  MoveList list;
+  generateMoves(player, list);
+  for (int i = 0; i < list.count; ++i) {
+    brd[list.moves[i]] = 3;
+  }
+  for (int i=1; i<6; ++i) {
+    out << "| ";
+    for (int j=1; j<6; ++j) {
+      char cell = brd[i*7+j];
+      if (cell == 0) {
+        out << "  | "; 
+      } else {
+        if (p1 == i*7+j || p2 == i*7+j) {
+          out << PLAYER(cell) << " | ";
+        } else if (cell == 3) {
+          out << "* | ";
+        } else {
+          out << "X | ";
+        }
+      }
+    }
+    out << '\n';
+  }
+}
+
+// Log-linear latency histogram in the style of HdrHistogram. Values are
+// kept in power of two buckets, each split into 2^SUB_BITS linear
+// sub-buckets, giving ~3% relative precision over the whole int64 range
+// with a fixed 16KB of counters.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+  void record(long long value);
+  void merge(const LatencyHistogram& other);
+  long long percentile(double p) const;
+  long long count() const { return total; }
+  long long max() const { return max_value; }
+
+ private:
+  static const int SUB_BITS = 5;
+  static const int SUB_COUNT = 1 << SUB_BITS;
+  static const int BUCKETS = (64 - SUB_BITS) * SUB_COUNT;
+
+  long long counts[BUCKETS];
+  long long total;
+  long long max_value;
+
+  static int indexOf(long long value);
+  static long long valueOf(int index);
+  static bool roundTrips();
+};
+
+LatencyHistogram::LatencyHistogram() {
+  static bool checked = roundTrips();
+  (void)checked;
+  memset(counts, 0, sizeof(counts));
+  total = 0;
+  max_value = 0;
+}
+
+int LatencyHistogram::indexOf(long long value) {
+  if (value < SUB_COUNT) return (value < 0) ? 0 : (int)value;
+  // The SUB_BITS bits below the leading one pick the sub-bucket.
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BITS;
+  return (shift + 1) * SUB_COUNT + (int)((value >> shift) & (SUB_COUNT - 1));
+}
+
+// Returns the highest value that maps to the given index.
+long long LatencyHistogram::valueOf(int index) {
+  if (index < SUB_COUNT) return index;
+  long long base = SUB_COUNT + index % SUB_COUNT;
+  return ((base + 1) << (index / SUB_COUNT - 1)) - 1;
+}
+
+// Checks once that every index maps back to itself from both ends of its
+// bucket.
+bool LatencyHistogram::roundTrips() {
+  for (int index = 0; index < BUCKETS; ++index) {
+    long long low = (index == 0) ? 0 : valueOf(index - 1) + 1;
+    if (indexOf(low) != index || indexOf(valueOf(index)) != index) {
+      cerr << "Latency histogram bucket " << index << " does not round trip" << endl;
+      abort();
+    }
+  }
+  return true;
+}
+
+void LatencyHistogram::record(long long value) {
+  counts[indexOf(value)]++;
+  total++;
+  if (value > max_value) max_value = value;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+  total += other.total;
+  if (other.max_value > max_value) max_value = other.max_value;
+}
+
+// Returns the value at or below which p percent of the samples fall.
+long long LatencyHistogram::percentile(double p) const {
+  if (total == 0) return 0;
+  long long rank = (long long)(p / 100.0 * total + 0.5);
+  if (rank < 1) rank = 1;
+  long long seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      long long value = valueOf(i);
+      return (value < max_value) ? value : max_value;
+    }
+  }
+  return max_value;
+}
+
+// Game phases used to break down move latency, by number of empty cells.
+enum Phase { OPENING, MIDDLEGAME, ENDGAME, NUM_PHASES };
+const char* PHASE_NAMES[] = {"opening", "middlegame", "endgame"};
+
+Phase phase_of(Board& board) {
+  int empty = board.emptyCells();
+  if (empty >= 17) return OPENING;
+  if (empty >= 9) return MIDDLEGAME;
+  return ENDGAME;
+}
+
+// Wall clock (monotonic) and CPU time of getMove calls, per engine and
+// game phase. A MoveStats can be kept for a single match and merged into
+// one covering a whole sweep.
+class MoveStats {
+ public:
+  static const int MAX_ENGINES = 2;
+
+  MoveStats();
+  void record(int engine, Phase phase, long long wall_ns, long long cpu_ns);
+  void merge(const MoveStats& other);
+  void print(ostream& out, const char* title, const char* engine_names[]);
+
+ private:
+  LatencyHistogram wall[MAX_ENGINES][NUM_PHASES];
+  long long cpu[MAX_ENGINES][NUM_PHASES];
+};
+
+MoveStats::MoveStats() {
+  memset(cpu, 0, sizeof(cpu));
+}
+
+void MoveStats::record(int engine, Phase phase, long long wall_ns, long long cpu_ns) {
+  wall[engine][phase].record(wall_ns);
+  cpu[engine][phase] += cpu_ns;
+}
+
+void MoveStats::merge(const MoveStats& other) {
+  for (int e = 0; e < MAX_ENGINES; ++e) {
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      wall[e][p].merge(other.wall[e][p]);
+      cpu[e][p] += other.cpu[e][p];
+    }
+  }
+}
+
+void MoveStats::print(ostream& out, const char* title, const char* engine_names[]) {
+  char line[128];
+  out << title << " (ms)\n";
+  snprintf(line, sizeof(line), "%-8s %-10s %6s %9s %9s %9s %9s %9s\n",
+           "engine", "phase", "moves", "p50", "p90", "p99", "max", "cpu/move");
+  out << line;
+  for (int e = 0; e < MAX_ENGINES; ++e) {
+    LatencyHistogram all;
+    long long all_cpu = 0;
+    for (int p = 0; p <= NUM_PHASES; ++p) {
+      const LatencyHistogram& h = (p < NUM_PHASES) ? wall[e][p] : all;
+      long long cpu_ns = (p < NUM_PHASES) ? cpu[e][p] : all_cpu;
+      if (p < NUM_PHASES) {
+        all.merge(h);
+        all_cpu += cpu_ns;
+      }
+      if (h.count() == 0) continue;
+      snprintf(line, sizeof(line),
+               "%-8s %-10s %6lld %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               engine_names[e], (p < NUM_PHASES) ? PHASE_NAMES[p] : "all",
+               h.count(), h.percentile(50) / 1e6, h.percentile(90) / 1e6,
+               h.percentile(99) / 1e6, h.max() / 1e6,
+               (double)cpu_ns / h.count() / 1e6);
+      out << line;
+    }
+  }
+}
+
+const char* MATCH_ENGINES[] = {"mirror", "negamax"};
+
+// Receives everything a match reports. Neither the engines nor play_match
+// write to stdout themselves; a sink decides what is printed and when.
+class OutputSink {
+ public:
+  virtual ~OutputSink() {}
+  virtual void matchStart(Board& /*board*/, char /*player*/) {}
+  virtual void move(Board& board, char player, int pos, long long wall_ns) = 0;
+  virtual void matchEnd(char loser, MoveStats& stats) = 0;
+  virtual void sweepEnd(MoveStats& /*stats*/) {}
+};
+
+// The human readable boards, buffered and written once per match.
+class HumanSink : public OutputSink {
+ public:
+  HumanSink(ostream* out) : out(out) {}
+  void move(Board& board, char player, int pos, long long wall_ns);
+  void matchEnd(char loser, MoveStats& stats);
+  void sweepEnd(MoveStats& stats);
+
+ private:
+  ostream* out;
+  ostringstream buffer;
+};
+
+void HumanSink::move(Board& board, char player, int pos, long long /*wall_ns*/) {
+  buffer << "Moved " << PLAYER(player) << " M: " << POS_TO_X(pos) << ", "
+         << POS_TO_Y(pos) << '\n';
+  board.printBoard(buffer);
+  buffer << '\n';
+}
+
+void HumanSink::matchEnd(char loser, MoveStats& stats) {
+  buffer << "Player:" << PLAYER(loser) << " Lost." << '\n';
+  stats.print(buffer, "Move latency", MATCH_ENGINES);
+  buffer << '\n';
+  *out << buffer.str();
+  out->flush();
+  buffer.str("");
+}
+
+void HumanSink::sweepEnd(MoveStats& stats) {
+  stats.print(*out, "Move latency over all matches", MATCH_ENGINES);
+  out->flush();
+}
+
+// Only the result of each match, and the latency summary of the sweep.
+class QuietSink : public OutputSink {
+ public:
+  QuietSink(ostream* out) : out(out) {}
+  void move(Board& /*board*/, char /*player*/, int /*pos*/, long long /*wall_ns*/) {}
+  void matchEnd(char loser, MoveStats& /*stats*/) {
+    *out << "Player:" << PLAYER(loser) << " Lost." << '\n';
+  }
+  void sweepEnd(MoveStats& stats) {
+    stats.print(*out, "Move latency over all matches", MATCH_ENGINES);
+    out->flush();
+  }
+
+ private:
+  ostream* out;
+};
+
+// One JSON object per line: a record per move and one per match result,
+// buffered and written once per match.
+class JsonSink : public OutputSink {
+ public:
+  JsonSink(ostream* out) : out(out), match(0), ply(0) {}
+  void matchStart(Board& board, char player);
+  void move(Board& board, char player, int pos, long long wall_ns);
+  void matchEnd(char loser, MoveStats& stats);
+
+ private:
+  ostream* out;
+  ostringstream buffer;
+  int match;
+  int ply;
+};
+
+string format_position(Board& board, char player);
+string square_name(int pos);
+
+void JsonSink::matchStart(Board& board, char player) {
+  match++;
+  ply = 0;
+  buffer << "{\"match\":" << match << ",\"start\":\""
+         << format_position(board, player) << "\"}\n";
+}
+
+void JsonSink::move(Board& /*board*/, char player, int pos, long long wall_ns) {
+  ply++;
+  buffer << "{\"match\":" << match << ",\"ply\":" << ply
+         << ",\"player\":" << PLAYER(player) << ",\"move\":\""
+         << square_name(pos) << "\",\"time_ms\":" << wall_ns / 1e6 << "}\n";
+}
+
+void JsonSink::matchEnd(char loser, MoveStats& /*stats*/) {
+  buffer << "{\"match\":" << match << ",\"winner\":"
+         << PLAYER(OPPONENT(loser)) << ",\"plies\":" << ply << "}\n";
+  *out << buffer.str();
+  out->flush();
+  buffer.str("");
+}
+
+// Settings and collectors for play_match. Any of the pointers may be NULL,
+// except for sink.
+struct MatchOptions {
+  OutputSink* sink;
+  // The per move timings of the match are merged into sweep_stats.
+  MoveStats* sweep_stats;
+  GameRecord* record;
+  // Shared by both engines.
+  AnalysisCache* cache;
+  // Lets negamax ponder on its expected reply while mirror thinks.
+  bool ponder;
+  // Plays the first side in place of mirror, if not NULL.
+  Engine* opponent;
+  SearchLimits opponent_limits;
+};
+
+void play_match(char player, Board& board, const MatchOptions& options);
+bool parse_settings(const string& text, map<string, string>* settings);
+Engine* engine_from_spec(const string& text, SearchLimits* limits);
+int run_bench(int argc, char* argv[]);
+int run_analyze(int argc, char* argv[]);
+int run_dump(int argc, char* argv[]);
+int run_engine(int argc, char* argv[]);
+int run_selfplay(int argc, char* argv[]);
+int run_tournament(int argc, char* argv[]);
+int run_tune(int argc, char* argv[]);
+int run_evalbench(int argc, char* argv[]);
+int run_train(int argc, char* argv[]);
+int run_prunetest(int argc, char* argv[]);
+int run_prove(int argc, char* argv[]);
+int run_solve(int argc, char* argv[]);
+ 
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return run_bench(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "analyze") == 0) {
+    return run_analyze(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "dump") == 0) {
+    return run_dump(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "engine") == 0) {
+    return run_engine(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "selfplay") == 0) {
+    return run_selfplay(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "tournament") == 0) {
+    return run_tournament(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "tune") == 0) {
+    return run_tune(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "evalbench") == 0) {
+    return run_evalbench(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "train") == 0) {
+    return run_train(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "prunetest") == 0) {
+    return run_prunetest(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "prove") == 0) {
+    return run_prove(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "solve") == 0) {
+    return run_solve(argc - 2, argv + 2);
+  }
+
+  // --record FILE saves every match of the sweep as a game record,
+  // --cache FILE warm starts the engines from a persistent analysis cache,
+  // --output human|quiet|json selects what is printed, --ponder lets
+  // negamax think on mirror's time and --opponent SPEC plays the first
+  // side with another engine, as in tournament.
+  ofstream record_file;
+  GameRecordWriter* writer = NULL;
+  AnalysisCache* cache = NULL;
+  OutputSink* sink = NULL;
+  bool ponder = false;
+  Engine* opponent = NULL;
+  SearchLimits opponent_limits;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--ponder") == 0) {
+      ponder = true;
+    } else if (strcmp(argv[i], "--opponent") == 0 && i + 1 < argc) {
+      delete opponent;
+      opponent = engine_from_spec(argv[++i], &opponent_limits);
+      if (opponent == NULL) {
+        cerr << "Invalid engine " << argv[i] << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      string mode = argv[++i];
+      delete sink;
+      if (mode == "human") {
+        sink = new HumanSink(&cout);
+      } else if (mode == "quiet") {
+        sink = new QuietSink(&cout);
+      } else if (mode == "json") {
+        sink = new JsonSink(&cout);
+      } else {
+        cerr << "Unknown output mode " << mode << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_file.open(argv[++i], ios::binary);
+      if (!record_file) {
+        cerr << "Cannot open " << argv[i] << endl;
+        return 1;
+      }
+      writer = new GameRecordWriter(&record_file);
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache = new AnalysisCache();
+      if (!cache->open(argv[++i])) {
+        cerr << "Invalid analysis cache " << argv[i] << endl;
+        return 1;
+      }
+    } else {
+      cerr << "Unknown option " << argv[i] << endl;
+      return 1;
+    }
+  }
+
+  if (sink == NULL) sink = new HumanSink(&cout);
+
+  MoveStats sweep_stats;
+  GameRecord record;
+  MatchOptions options = {sink, &sweep_stats, &record, cache, ponder, opponent,
+                          opponent_limits};
+  for (int i = 0; i < 5; ++i) {
+    for (int j = 0; j < 5; ++j) {
+      if (i == 0 && j == 0) continue;
+      Board board;
+      board.play(0, 0, P1);
+      board.play(i, j, P2);
+      play_match(P1, board, options);
+      if (writer != NULL) writer->write(record);
+    }
+  }
+  sink->sweepEnd(sweep_stats);
+  delete sink;
+  if (writer != NULL && !writer->ok()) {
+    cerr << "Failed writing game records" << endl;
+    return 1;
+  }
+  delete writer;
+  delete opponent;
+  if (cache != NULL && !cache->flush()) {
+    cerr << "Failed writing analysis cache" << endl;
+    return 1;
+  }
+  delete cache;
+  return 0;
+}
+
+// Plays a match from the given position, timing each side's moves, and
+// reports it to the options' sink.
+//
+// When pondering, negamax keeps searching the position after its
+// expected reply on a background thread while mirror thinks. If mirror
+// plays that reply the search simply goes on, and negamax's move time
+// counts from then. Otherwise the ponder search is stopped and thrown
+// away.
+void play_match(char player, Board& board, const MatchOptions& options) {
+  int best_move;
+  Negamax negamax;
+  Negamax mirror;
+  negamax.setCache(options.cache);
+  mirror.setCache(options.cache);
+  int count = 0;
+  MoveStats stats;
+  GameRecord* record = options.record;
+  options.sink->matchStart(board, player);
+  if (record != NULL) {
+    record->start = pack_position(board, player);
+    record->moves.clear();
+    record->winner = EMPTY;
+  }
+  thread ponder_thread;
+  Board ponder_board;
+  atomic<bool> pondering(false);
+  atomic<bool> ponder_stop(false);
+  SearchLimits ponder_limits;
+  ponder_limits.stop = &ponder_stop;
+  ponder_limits.ponder = &pondering;
+  SearchResult ponder_result;
+  int ponder_move = 0;
+  int last_move = 0;
+  // negamax's principal variation from its last move, whose rest it
+  // searches first if the opponent replies as expected.
+  vector<int> expected;
+
+  while (true) { 
+    int ap_pos = (player == P1) ? board.p1 : board.p2;
+    int pp_pos = (player == P1) ? board.p2 : board.p1;
+    if (board.hasLost(ap_pos)) {
+      if (record != NULL) record->winner = OPPONENT(player);
+      options.sink->matchEnd(player, stats);
+      break;
+    }
+    
+    int best_move;
+    int engine = count % 2;
+    Phase phase = phase_of(board);
+    long long wall_start = monotonic_ns();
+    long long cpu_start = thread_cpu_ns();
+    if (engine == 0 && options.opponent != NULL) {
+      Board copy = board;
+      best_move = options.opponent->getMove(&copy, player, options.opponent_limits);
+    } else if (engine == 0) {
+      best_move = mirror.getMove(&board, player, 25);
+    } else {
+      SearchResult result;
+      bool ponder_hit = false;
+      if (ponder_thread.joinable()) {
+        ponder_hit = last_move == ponder_move;
+        if (ponder_hit) {
+          pondering = false;
+        } else {
+          ponder_stop = true;
+        }
+        ponder_thread.join();
+        result = ponder_result;
+      }
+      if (!ponder_hit) {
+        SearchLimits limits;
+        if (expected.size() > 2 && expected[1] == last_move) {
+          limits.pv.assign(expected.begin() + 2, expected.end());
+        }
+        negamax.getMove(&board, player, limits, &result);
+      }
+      best_move = result.move;
+      expected = result.pv;
+
+      if (options.ponder && result.ponder != 0) {
+        ponder_board = board;
+        ponder_board.play(POS_TO_X(best_move), POS_TO_Y(best_move), player);
+        ponder_board.play(POS_TO_X(result.ponder), POS_TO_Y(result.ponder),
+                          OPPONENT(player));
+        pondering = true;
+        ponder_stop = false;
+        ponder_move = result.ponder;
+        ponder_limits.pv.clear();
+        if (result.pv.size() > 2) {
+          ponder_limits.pv.assign(result.pv.begin() + 2, result.pv.end());
+        }
+        ponder_thread = thread([&negamax, &ponder_board, &ponder_limits,
+                                &ponder_result, player]() {
+          negamax.getMove(&ponder_board, player, ponder_limits, &ponder_result);
+        });
+      }
+    }
+    long long wall_ns = monotonic_ns() - wall_start;
+    stats.record(engine, phase, wall_ns, thread_cpu_ns() - cpu_start);
+    count++;
+    int x, y; 
+    x = POS_TO_X(best_move);
+    y = POS_TO_Y(best_move);
+    board.play(x, y, player);
+    if (record != NULL) record->moves.push_back(x*5+y);
+    options.sink->move(board, player, best_move, wall_ns);
+    last_move = best_move;
+    player = OPPONENT(player);
+  }
+  if (ponder_thread.joinable()) {
+    ponder_stop = true;
+    ponder_thread.join();
+  }
+  if (options.sweep_stats != NULL) options.sweep_stats->merge(stats);
+}
+
+// Plays a space separated list of "xy" squares on the board, alternating
+// sides starting with player one. The first two entries are the initial
+// token placements. Returns the side to move, or 0 if the list is invalid.
+char setup_moves(Board& board, const char* moves) {
+  char player = P1;
+  istringstream in(moves);
+  string move;
+  while (in >> move) {
+    if (move.size() != 2) return 0;
+    int x = move[0] - '0';
+    int y = move[1] - '0';
+    if (x < 0 || x > 4 || y < 0 || y > 4 || !board.isLegal(x, y)) return 0;
+    board.play(x, y, player);
+    player = OPPONENT(player);
+  }
+  return player;
+}
+
+// Fixed positions searched by the bench command, as setup_moves() lists,
+// together with the depth each one is searched to. Changing this table
+// changes the bench signature.
+struct BenchPosition {
+  const char* moves;
+  int depth;
+};
+
+const BenchPosition BENCH_POSITIONS[] = {
+  {"00 11", 9},
+  {"00 22", 9},
+  {"00 12", 9},
+  {"04 34", 9},
+  {"01 03", 9},
+  {"12 34 21 31", 10},
+  {"12 20 14 42 32", 10},
+  {"34 13 01 33 23 11", 11},
+  {"33 02 03 32 04 31 24", 11},
+  {"20 04 10 31 11 33 13 24", 12},
+  {"12 22 30 21 34 20 32 00 31", 12},
+  {"24 40 44 20 41 23 42 03 02 21", 14},
+  {"33 01 13 41 04 42 02 22 20 12 11", 14},
+  {"24 33 04 03 40 13 43 02 21 12 23 32", 16},
+  {"30 13 03 31 21 22 11 33 12 43 01 41 10 23", 25},
+};
+
+// Searches every bench position single threaded and prints the total node
+// count and speed. The node count is a signature of the search: it only
+// changes when search behaviour changes, while nodes/second tracks speed.
+// An optional number adds to the depth of every position, and an optional
+// "name=value,..." list sets search options, e.g. "lmr=1".
+int run_bench(int argc, char* argv[]) {
+  int extra_depth = 0;
+  SearchOptions options;
+  for (int i = 0; i < argc; ++i) {
+    map<string, string> settings;
+    if (strchr(argv[i], '=') == NULL) {
+      extra_depth = atoi(argv[i]);
+      continue;
+    }
+    if (!parse_settings(argv[i], &settings)) settings["?"] = argv[i];
+    for (map<string, string>::iterator it = settings.begin();
+         it != settings.end(); ++it) {
+      if (!set_search_option(it->first, it->second, &options)) {
+        cerr << "Invalid search option " << it->first << endl;
+        return 1;
+      }
+    }
+  }
+  long long total_nodes = 0;
+  long long reductions = 0;
+  long long researches = 0;
+  long long futility_prunes = 0;
+  long long razor_prunes = 0;
+  long long passes = 0;
+  Negamax negamax;
+  negamax.setOptions(options);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  int count = sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]);
+  for (int i = 0; i < count; ++i) {
+    Board board;
+    char player = setup_moves(board, BENCH_POSITIONS[i].moves);
+    if (player == 0) {
+      cerr << "Invalid bench position " << i + 1 << endl;
+      return 1;
+    }
+    int depth = BENCH_POSITIONS[i].depth + extra_depth;
+    int move = negamax.getMove(&board, player, depth);
+    total_nodes += negamax.node_count;
+    reductions += negamax.lmr_reductions;
+    researches += negamax.lmr_researches;
+    futility_prunes += negamax.futility_prunes;
+    razor_prunes += negamax.razor_prunes;
+    passes += negamax.mtdf_passes;
+    printf("Position %2d/%d depth %2d move %d,%d nodes %lld\n", i + 1, count,
+           depth, POS_TO_X(move), POS_TO_Y(move), negamax.node_count);
+  }
+
+  double elapsed = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  long long nps = (elapsed > 0) ? (long long)(total_nodes / elapsed) : 0;
+  printf("===========================\n");
+  printf("Total time (ms) : %lld\n", (long long)(elapsed * 1000));
+  printf("Nodes searched  : %lld\n", total_nodes);
+  printf("Nodes/second    : %lld\n", nps);
+  if (options.lmr) {
+    printf("Reductions      : %lld, %lld searched again\n", reductions, researches);
+  }
+  if (options.futility || options.razoring) {
+    printf("Pruned          : %lld futility, %lld razoring\n", futility_prunes,
+           razor_prunes);
+  }
+  if (options.mtdf) printf("MTD(f) passes   : %lld\n", passes);
+  return 0;
+}
+
+// Positions are written in a compact text notation of four fields:
+//   <occupancy> <p1> <p2> <side>
+// occupancy is the hex value of a 25 bit mask of the non empty cells, bit
+// x*5+y standing for cell (x, y). p1 and p2 are the "xy" squares of the
+// tokens, or "-" when a token is not placed yet, and side is 1 or 2.
+// For example "1000041 00 11 1" is P1 at (0,0), P2 at (1,1), P1 to move
+// with (4,4) blocked.
+string square_name(int pos) {
+  if (pos == 0) return "-";
+  char name[3] = {(char)('0' + POS_TO_X(pos)), (char)('0' + POS_TO_Y(pos)), 0};
+  return name;
+}
+
+string format_position(Board& board, char player) {
+  int occupancy = 0;
+  for (int x = 0; x < 5; ++x) {
+    for (int y = 0; y < 5; ++y) {
+      if (board.board[XY_TO_POS(x, y)] != EMPTY) occupancy |= 1 << (x*5+y);
+    }
+  }
+  char mask[9];
+  snprintf(mask, sizeof(mask), "%x", occupancy);
+  return string(mask) + " " + square_name(board.p1) + " " +
+      square_name(board.p2) + " " + PLAYER(player);
+}
+
+// Parses a position written by format_position(). Returns false if the
+// text is malformed.
+bool parse_position(const string& text, Board* board, char* player) {
+  istringstream in(text);
+  string occupancy, p1, p2, side;
+  if (!(in >> occupancy >> p1 >> p2 >> side)) return false;
+  char* end;
+  long mask = strtol(occupancy.c_str(), &end, 16);
+  if (*end != 0 || mask < 0 || mask >= (1 << 25)) return false;
+  if (side != "1" && side != "2") return false;
+
+  *board = Board();
+  for (int sq = 0; sq < 25; ++sq) {
+    if (mask & (1 << sq)) board->board[XY_TO_POS(sq / 5, sq % 5)] = BORDER;
+  }
+  const string* tokens[] = {&p1, &p2};
+  for (int i = 0; i < 2; ++i) {
+    const string& token = *tokens[i];
+    if (token == "-") continue;
+    if (token.size() != 2) return false;
+    int x = token[0] - '0';
+    int y = token[1] - '0';
+    if (x < 0 || x > 4 || y < 0 || y > 4) return false;
+    board->play(x, y, (i == 0) ? P1 : P2);
+  }
+  if (board->p1 != 0 && board->p1 == board->p2) return false;
+  *player = (side == "1") ? P1 : P2;
+  return true;
+}
+
+// Reads positions one per line, from a file or stdin, and analyzes them
+// on a pool of worker threads. A JSON line with the best move, score,
+// node count and time is written as soon as each position is done, so
+// results come out in completion order and carry the input line number.
+class BatchAnalyzer {
+ public:
+  BatchAnalyzer(istream* in, const SearchLimits& limits, AnalysisCache* cache)
+      : in(in), limits(limits), cache(cache), line_number(0) {}
+  void run(int threads);
+
+ private:
+  istream* in;
+  SearchLimits limits;
+  AnalysisCache* cache;
+  int line_number;
+  mutex input_lock;
+  mutex output_lock;
+
+  bool nextLine(string* line, int* id);
+  void worker();
+  void analyze(const string& line, int id, Negamax* negamax);
+};
+
+void BatchAnalyzer::run(int threads) {
+  vector<thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(thread(&BatchAnalyzer::worker, this));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+}
+
+// Skips blank lines and '#' comments.
+bool BatchAnalyzer::nextLine(string* line, int* id) {
+  lock_guard<mutex> lock(input_lock);
+  while (getline(*in, *line)) {
+    line_number++;
+    size_t start = line->find_first_not_of(" \t\r");
+    if (start == string::npos || (*line)[start] == '#') continue;
+    *id = line_number;
+    return true;
+  }
+  return false;
+}
+
+void BatchAnalyzer::worker() {
+  Negamax negamax;
+  negamax.setCache(cache);
+  string line;
+  int id;
+  while (nextLine(&line, &id)) {
+    analyze(line, id, &negamax);
+  }
+}
+
+void BatchAnalyzer::analyze(const string& line, int id, Negamax* negamax) {
+  Board board;
+  char player;
+  ostringstream out;
+  out << "{\"id\":" << id;
+  if (!parse_position(line, &board, &player)) {
+    out << ",\"error\":\"invalid position\"}";
+  } else {
+    long long start = monotonic_ns();
+    SearchResult result;
+    negamax->getMove(&board, player, limits, &result);
+    double time_ms = (monotonic_ns() - start) / 1e6;
+    out << ",\"position\":\"" << format_position(board, player) << "\"";
+    if (result.move == 0) {
+      out << ",\"move\":null";
+    } else {
+      out << ",\"move\":\"" << square_name(result.move) << "\"";
+    }
+    out << ",\"score\":" << result.score << ",\"pv\":[";
+    for (size_t i = 0; i < result.pv.size(); ++i) {
+      out << (i ? "," : "") << "\"" << square_name(result.pv[i]) << "\"";
+    }
+    out << "]";
+    if (!result.lines.empty()) {
+      out << ",\"lines\":[";
+      for (size_t i = 0; i < result.lines.size(); ++i) {
+        const RootLine& line = result.lines[i];
+        out << (i ? "," : "") << "{\"move\":\"" << square_name(line.move)
+            << "\",\"score\":" << line.score << ",\"bound\":\""
+            << (line.bound == BOUND_EXACT ? "exact" : "lower") << "\",\"pv\":[";
+        for (size_t j = 0; j < line.pv.size(); ++j) {
+          out << (j ? "," : "") << "\"" << square_name(line.pv[j]) << "\"";
+        }
+        out << "]}";
+      }
+      out << "]";
+    }
+    out << ",\"depth\":" << result.depth
+        << ",\"nodes\":" << result.nodes << ",\"time_ms\":" << time_ms << "}";
+  }
+  lock_guard<mutex> lock(output_lock);
+  cout << out.str() << endl;
+}
+
+// analyze [--depth N] [--time MS] [--threads N] [--multipv K] [--cache FILE] [FILE]
+int run_analyze(int argc, char* argv[]) {
+  SearchLimits limits;
+  int threads = thread::hardware_concurrency();
+  const char* path = NULL;
+  AnalysisCache* cache = NULL;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--cache" && i + 1 < argc) {
+      cache = new AnalysisCache();
+      if (!cache->open(argv[++i])) {
+        cerr << "Invalid analysis cache " << argv[i] << endl;
+        return 1;
+      }
+    } else if (arg == "--depth" && i + 1 < argc) {
+      limits.depth = atoi(argv[++i]);
+    } else if (arg == "--time" && i + 1 < argc) {
+      limits.time_ms = atoll(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (arg == "--multipv" && i + 1 < argc) {
+      limits.multipv = atoi(argv[++i]);
+    } else if (arg != "-" && arg[0] == '-') {
+      cerr << "Unknown option " << arg << endl;
+      return 1;
+    } else if (arg != "-") {
+      path = argv[i];
+    }
+  }
+  if (threads < 1) threads = 1;
+
+  ifstream file;
+  if (path != NULL) {
+    file.open(path);
+    if (!file) {
+      cerr << "Cannot open " << path << endl;
+      return 1;
+    }
+  }
+  BatchAnalyzer analyzer(path != NULL ? &file : &cin, limits, cache);
+  analyzer.run(threads);
+  if (cache != NULL && !cache->flush()) {
+    cerr << "Failed writing analysis cache" << endl;
+    return 1;
+  }
+  delete cache;
+  return 0;
+}
+
+// dump FILE...
+// Prints game records as the start position followed by the moves, both
+// in the text notations above, and the winner.
+int run_dump(int argc, char* argv[]) {
+  for (int i = 0; i < argc; ++i) {
+    ifstream file(argv[i], ios::binary);
+    if (!file) {
+      cerr << "Cannot open " << argv[i] << endl;
+      return 1;
+    }
+    GameRecordReader reader(&file);
+    GameRecord record;
+    while (reader.read(&record)) {
+      Board board;
+      char player;
+      unpack_position(record.start, &board, &player);
+      cout << format_position(board, player) << " :";
+      for (size_t m = 0; m < record.moves.size(); ++m) {
+        cout << " " << record.moves[m] / 5 << record.moves[m] % 5;
+      }
+      cout << " : " << ((record.winner == EMPTY) ? '-' : PLAYER(record.winner)) << endl;
+    }
+    if (!reader.ok()) {
+      cerr << argv[i] << ": malformed game records" << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A resident engine driven by a line protocol over stdin and stdout, so
+// that a controller can keep it, and its caches, alive across games:
+//   position startpos [moves xy...]
+//   position <occupancy> <p1> <p2> <side> [moves xy...]
+//   move xy              play a move for the side to move
+//   go [ponder] [depth N] [movetime MS] [nodes N] [infinite]
+//                        infinite holds bestmove back until stop
+//   ponderhit            the pondered move was played; the limits start now
+//   stop                 end the search, which still reports its bestmove
+//   isready              answered with readyok
+//   d                    print the board and the position
+//   quit
+// A search runs in the background and reports
+// "info depth D score S nodes N time MS" after every iteration and
+// "bestmove xy [ponder xy]" or "bestmove none" when it is done. Commands
+// that change the position or start a search stop the current search
+// first.
+//
+// To ponder, a controller sets up the position after the expected reply
+// from "bestmove ... ponder xy" and sends "go ponder" with the limits for
+// the next move. On a ponder hit it sends "ponderhit" and the search goes
+// on, with everything it has done so far. On a miss it sends "stop",
+// ignores the bestmove and starts over with the actual position. A ponder
+// search never reports bestmove before "ponderhit" or "stop".
+class EngineSession : public SearchListener {
+ public:
+  EngineSession(AnalysisCache* cache);
+  void run(istream& in);
+  void iterationDone(const SearchResult& result, long long time_ns);
+
+ private:
+  Negamax negamax;
+  Board board;
+  char player;
+  thread search_thread;
+  atomic<bool> stop_flag;
+  atomic<bool> ponder_flag;
+  mutex output_lock;
+
+  void send(const string& line);
+  void setPosition(istringstream& args);
+  bool playMoves(istringstream& args);
+  void go(istringstream& args);
+  void stopSearch();
+  void search(Board board, char player, SearchLimits limits, bool infinite);
+};
+
+EngineSession::EngineSession(AnalysisCache* cache) : player(P1) {
+  negamax.setCache(cache);
+  negamax.setListener(this);
+  stop_flag = false;
+  ponder_flag = false;
+}
+
+void EngineSession::send(const string& line) {
+  lock_guard<mutex> lock(output_lock);
+  cout << line << endl;
+}
+
+void EngineSession::run(istream& in) {
+  string line;
+  while (getline(in, line)) {
+    istringstream args(line);
+    string command;
+    if (!(args >> command)) continue;
+    if (command == "quit") {
+      break;
+    } else if (command == "isready") {
+      send("readyok");
+    } else if (command == "stop") {
+      stopSearch();
+    } else if (command == "ponderhit") {
+      ponder_flag = false;
+    } else if (command == "position") {
+      stopSearch();
+      setPosition(args);
+    } else if (command == "move") {
+      stopSearch();
+      if (!playMoves(args)) send("info string illegal move");
+    } else if (command == "go") {
+      stopSearch();
+      go(args);
+    } else if (command == "d") {
+      ostringstream out;
+      board.printBoard(out);
+      out << format_position(board, player);
+      send(out.str());
+    } else {
+      send("info string unknown command " + command);
+    }
+  }
+  stopSearch();
+}
+
+void EngineSession::setPosition(istringstream& args) {
+  string first;
+  args >> first;
+  Board position;
+  char side = P1;
+  if (first != "startpos") {
+    string p1, p2, side_name;
+    args >> p1 >> p2 >> side_name;
+    if (!parse_position(first + " " + p1 + " " + p2 + " " + side_name,
+                        &position, &side)) {
+      send("info string invalid position");
+      return;
+    }
+  }
+  board = position;
+  player = side;
+  string word;
+  if (args >> word && (word != "moves" || !playMoves(args))) {
+    send("info string illegal move");
+  }
+}
+
+// Plays the "xy" moves that follow in args, stopping at an illegal one.
+bool EngineSession::playMoves(istringstream& args) {
+  string move;
+  while (args >> move) {
+    int x = (move.size() == 2) ? move[0] - '0' : -1;
+    int y = (move.size() == 2) ? move[1] - '0' : -1;
+    if (x < 0 || x > 4 || y < 0 || y > 4 ||
+        !board.canMove(player, XY_TO_POS(x, y))) {
+      return false;
+    }
+    board.play(x, y, player);
+    player = OPPONENT(player);
+  }
+  return true;
+}
+
+void EngineSession::go(istringstream& args) {
+  SearchLimits limits;
+  limits.iterate = true;
+  bool ponder = false;
+  bool infinite = false;
+  string word;
+  while (args >> word) {
+    if (word == "ponder") {
+      ponder = true;
+    } else if (word == "infinite") {
+      infinite = true;
+    } else if (word == "depth") {
+      args >> limits.depth;
+    } else if (word == "movetime") {
+      args >> limits.time_ms;
+    } else if (word == "nodes") {
+      args >> limits.nodes;
+    } else if (word == "multipv") {
+      args >> limits.multipv;
+    } else {
+      send("info string unknown go parameter " + word);
+      return;
+    }
+  }
+  stop_flag = false;
+  ponder_flag = ponder;
+  limits.stop = &stop_flag;
+  limits.ponder = &ponder_flag;
+  search_thread = thread(&EngineSession::search, this, board, player, limits,
+                         infinite);
+}
+
+void EngineSession::stopSearch() {
+  if (!search_thread.joinable()) return;
+  stop_flag = true;
+  search_thread.join();
+}
+
+// Runs on the search thread, with its own copy of the board.
+void EngineSession::search(Board board, char player, SearchLimits limits,
+                           bool infinite) {
+  SearchResult result;
+  int move = negamax.getMove(&board, player, limits, &result);
+  while ((infinite || ponder_flag) && !stop_flag) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  if (move == 0) {
+    send("bestmove none");
+  } else if (result.ponder == 0) {
+    send("bestmove " + square_name(move));
+  } else {
+    send("bestmove " + square_name(move) + " ponder " + square_name(result.ponder));
+  }
+}
+
+void EngineSession::iterationDone(const SearchResult& result, long long time_ns) {
+  if (result.lines.empty()) {
+    ostringstream out;
+    out << "info depth " << result.depth << " score " << result.score
+        << " nodes " << result.nodes << " time " << time_ns / 1000000 << " pv";
+    for (size_t i = 0; i < result.pv.size(); ++i) out << " " << square_name(result.pv[i]);
+    send(out.str());
+    return;
+  }
+  for (size_t i = 0; i < result.lines.size(); ++i) {
+    const RootLine& line = result.lines[i];
+    ostringstream out;
+    out << "info depth " << result.depth << " multipv " << i + 1
+        << " score " << line.score
+        << (line.bound == BOUND_LOWER ? " lowerbound" : "")
+        << " nodes " << result.nodes << " time " << time_ns / 1000000 << " pv";
+    for (size_t j = 0; j < line.pv.size(); ++j) out << " " << square_name(line.pv[j]);
+    send(out.str());
+  }
+}
+
+// engine [--cache FILE]
+int run_engine(int argc, char* argv[]) {
+  AnalysisCache* cache = NULL;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache = new AnalysisCache();
+      if (!cache->open(argv[++i])) {
+        cerr << "Invalid analysis cache " << argv[i] << endl;
+        return 1;
+      }
+    } else {
+      cerr << "Unknown option " << argv[i] << endl;
+      return 1;
+    }
+  }
+  EngineSession session(cache);
+  session.run(cin);
+  if (cache != NULL && !cache->flush()) {
+    cerr << "Failed writing analysis cache" << endl;
+    return 1;
+  }
+  delete cache;
+  return 0;
+}
+
+// Splits a "key=value,key=value" list. Returns false if an entry has no
+// value.
+bool parse_settings(const string& text, map<string, string>* settings) {
+  istringstream in(text);
+  string item;
+  while (getline(in, item, ',')) {
+    size_t eq = item.find('=');
+    if (eq == string::npos || eq == 0) return false;
+    (*settings)[item.substr(0, eq)] = item.substr(eq + 1);
+  }
+  return true;
+}
+
+// Fills moves with the squares player can move to, in increasing order, and
+// returns how many there are.
+int list_moves(Board& board, char player, int* moves) {
+  MoveList list;
+  board.generateMoves(player, list);
+  copy(list.moves, list.moves + list.count, moves);
+  sort(moves, moves + list.count);
+  return list.count;
+}
+
+// Plays random token placements and then up to plies random moves on an
+// empty board, appending the squares played to moves. Stops early if the
+// side to move has no move. Returns the side to move.
+char random_opening(Board* board, int plies, mt19937_64& rng, vector<int>* moves) {
+  int squares[32];
+  char player = P1;
+  for (int ply = 0; ply < 2 + plies; ++ply) {
+    int count = list_moves(*board, player, squares);
+    if (count == 0) break;
+    int move = squares[rng() % count];
+    board->play(POS_TO_X(move), POS_TO_Y(move), player);
+    moves->push_back(POS_TO_SQ(move));
+    player = OPPONENT(player);
+  }
+  return player;
+}
+
+// Returns a new scorer by name, or NULL if there is no such scorer.
+// "weighted:FILE" is a WeightedScorer with the weights in FILE, and
+// "neural:FILE" a NeuralScorer with the network in FILE.
+Scorer* make_scorer(const string& name) {
+  if (name == "dijkstra") return new DijkstraScorer();
+  if (name == "weighted") return new WeightedScorer();
+  if (name.compare(0, 7, "neural:") == 0) {
+    NeuralScorer* scorer = new NeuralScorer();
+    if (scorer->load(name.substr(7))) return scorer;
+    delete scorer;
+  }
+  if (name.compare(0, 9, "weighted:") == 0) {
+    WeightedScorer* scorer = new WeightedScorer();
+    if (scorer->load(name.substr(9))) return scorer;
+    delete scorer;
+  }
+  return NULL;
+}
+
+// An engine variant for matches, written as "mirror", as
+// "negamax[:SETTINGS]" where SETTINGS is a "depth=N,time=MS,nodes=N,
+// scorer=NAME" list plus any search options, or as "mcts[:SETTINGS]" with
+// time, nodes (playouts) and MctsOptions settings.
+struct EngineSpec {
+  string text;
+  string kind;
+  string scorer;
+  SearchLimits limits;
+  SearchOptions options;
+  MctsOptions mcts;
+};
+
+bool parse_engine_spec(const string& text, EngineSpec* spec) {
+  spec->text = text;
+  spec->kind = text.substr(0, text.find(':'));
+  spec->scorer = "dijkstra";
+  spec->limits = SearchLimits();
+  spec->options = SearchOptions();
+  spec->mcts = MctsOptions();
+  if (spec->kind != "mirror" && spec->kind != "negamax" && spec->kind != "mcts") {
+    return false;
+  }
+  map<string, string> settings;
+  if (text.find(':') != string::npos &&
+      !parse_settings(text.substr(text.find(':') + 1), &settings)) {
+    return false;
+  }
+  for (map<string, string>::iterator it = settings.begin();
+       it != settings.end(); ++it) {
+    const char* value = it->second.c_str();
+    if (it->first == "depth") {
+      spec->limits.depth = atoi(value);
+    } else if (it->first == "time") {
+      spec->limits.time_ms = atoll(value);
+    } else if (it->first == "nodes") {
+      spec->limits.nodes = atoll(value);
+    } else if (it->first == "scorer") {
+      spec->scorer = it->second;
+    } else if (spec->kind == "mcts") {
+      if (!set_mcts_option(it->first, it->second, &spec->mcts)) return false;
+    } else if (!set_search_option(it->first, it->second, &spec->options)) {
+      return false;
+    }
+  }
+  Scorer* scorer = make_scorer(spec->scorer);
+  delete scorer;
+  return scorer != NULL;
+}
+
+Engine* make_engine(const EngineSpec& spec) {
+  if (spec.kind == "mirror") return new Mirror();
+  if (spec.kind == "mcts") return new MctsEngine(spec.mcts);
+  Negamax* negamax = new Negamax(make_scorer(spec.scorer));
+  negamax->setOptions(spec.options);
+  return negamax;
+}
+
+// Returns a new engine for an EngineSpec text and sets its limits, or
+// returns NULL if the text is invalid.
+Engine* engine_from_spec(const string& text, SearchLimits* limits) {
+  EngineSpec spec;
+  if (!parse_engine_spec(text, &spec)) return NULL;
+  *limits = spec.limits;
+  return make_engine(spec);
+}
+
+// How one side plays in self-play games: the engine and its limits, and
+// the chance of playing a uniformly random legal move instead.
+struct SideConfig {
+  EngineSpec engine;
+  double noise;
+};
+
+// Parses an EngineSpec with an extra "noise=P" setting into config. A
+// list of settings without an engine name is for negamax, so
+// "depth=6,noise=0.1" is "negamax:depth=6" with noise 0.1.
+bool parse_side_config(const string& text, SideConfig* config) {
+  size_t colon = text.find(':');
+  string kind = text.substr(0, colon);
+  string list = (colon == string::npos) ? "" : text.substr(colon + 1);
+  if (kind.find('=') != string::npos) {
+    kind = "negamax";
+    list = text;
+  }
+  map<string, string> settings;
+  if (!list.empty() && !parse_settings(list, &settings)) return false;
+  config->noise = 0;
+  if (settings.count("noise") > 0) {
+    config->noise = atof(settings["noise"].c_str());
+    settings.erase("noise");
+  }
+  string spec = kind;
+  for (map<string, string>::iterator it = settings.begin();
+       it != settings.end(); ++it) {
+    spec += (it == settings.begin()) ? ":" : ",";
+    spec += it->first + "=" + it->second;
+  }
+  return parse_engine_spec(spec, &config->engine);
+}
+
+// Plays self-play games on a pool of threads and writes them as game
+// records, in shards of a fixed number of games. Every game starts from
+// random token placements followed by a number of random moves, and is
+// recorded from the empty board. Game i is played with its own random
+// generator seeded from (seed, i), so with fixed depth limits the corpus
+// does not depend on the number of threads, only its sharding does.
+class SelfPlay {
+ public:
+  SelfPlay(const SideConfig sides[2], int random_plies, uint64_t seed,
+           const string& prefix, int shard_games)
+      : random_plies(random_plies), seed(seed), prefix(prefix),
+        shard_games(shard_games), next_game(0), next_shard(0),
+        games_done(0), plies_done(0), failed(false) {
+    this->sides[0] = sides[0];
+    this->sides[1] = sides[1];
+  }
+  // Returns false if writing a shard failed.
+  bool run(long long games, int threads);
+
+ private:
+  SideConfig sides[2];
+  int random_plies;
+  uint64_t seed;
+  string prefix;
+  int shard_games;
+  long long total_games;
+  atomic<long long> next_game;
+  atomic<int> next_shard;
+  atomic<long long> games_done;
+  atomic<long long> plies_done;
+  atomic<bool> failed;
+  atomic<long long> last_report;
+
+  void worker();
+  void playGame(long long index, Engine** engines, GameRecord* record);
+};
+
+bool SelfPlay::run(long long games, int threads) {
+  total_games = games;
+  long long start = monotonic_ns();
+  last_report = start;
+  vector<thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(thread(&SelfPlay::worker, this));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+
+  double elapsed = (monotonic_ns() - start) / 1e9;
+  double rate = (elapsed > 0) ? games_done / elapsed : 0;
+  printf("Games           : %lld\n", (long long)games_done);
+  printf("Positions       : %lld\n", (long long)plies_done);
+  printf("Shards          : %d\n", (int)next_shard);
+  printf("Total time (ms) : %lld\n", (long long)(elapsed * 1000));
+  printf("Games/second    : %.1f\n", rate);
+  printf("Games/s/thread  : %.1f\n", rate / threads);
+  return !failed;
+}
+
+void SelfPlay::worker() {
+  Engine* engines[2] = {make_engine(sides[0].engine), make_engine(sides[1].engine)};
+  GameRecord record;
+  ofstream shard;
+  GameRecordWriter* writer = NULL;
+  int in_shard = 0;
+
+  while (!failed) {
+    long long index = next_game++;
+    if (index >= total_games) break;
+    playGame(index, engines, &record);
+    if (writer == NULL || in_shard == shard_games) {
+      delete writer;
+      shard.close();
+      char name[16];
+      snprintf(name, sizeof(name), "-%05d.isog", (int)next_shard++);
+      shard.open((prefix + name).c_str(), ios::binary);
+      writer = new GameRecordWriter(&shard);
+      in_shard = 0;
+    }
+    if (!writer->write(record)) failed = true;
+    in_shard++;
+    games_done++;
+    plies_done += record.moves.size();
+    // Progress on stderr, from whichever worker finds it due.
+    long long now = monotonic_ns();
+    long long last = last_report;
+    if (now - last >= 5000000000LL && last_report.compare_exchange_strong(last, now)) {
+      cerr << games_done << "/" << total_games << " games" << endl;
+    }
+  }
+  delete writer;
+  delete engines[0];
+  delete engines[1];
+  // A worker that found no game left never opened a shard.
+  if (shard.is_open()) {
+    shard.close();
+    if (shard.fail()) failed = true;
+  }
+}
+
+void SelfPlay::playGame(long long index, Engine** engines, GameRecord* record) {
+  mt19937_64 rng(seed * 0x9E3779B97F4A7C15ULL + index);
+  uniform_real_distribution<double> chance(0.0, 1.0);
+  Board board;
+  record->start = pack_position(board, P1);
+  record->moves.clear();
+  record->winner = EMPTY;
+  char player = random_opening(&board, random_plies, rng, &record->moves);
+
+  int moves[32];
+  while (true) {
+    int count = list_moves(board, player, moves);
+    if (count == 0) {
+      record->winner = OPPONENT(player);
+      break;
+    }
+    int side = (player == P1) ? 0 : 1;
+    int move;
+    if (chance(rng) < sides[side].noise) {
+      move = moves[rng() % count];
+    } else {
+      Board copy = board;
+      move = engines[side]->getMove(&copy, player, sides[side].engine.limits);
+    }
+    if (!board.canMove(player, move)) {
+      // An illegal move loses, as in tournament games.
+      record->winner = OPPONENT(player);
+      break;
+    }
+    board.play(POS_TO_X(move), POS_TO_Y(move), player);
+    record->moves.push_back(POS_TO_SQ(move));
+    player = OPPONENT(player);
+  }
+}
+
+// selfplay [--games N] [--threads N] [--out PREFIX] [--shard-games N]
+//          [--random-plies N] [--seed N] [--p1 SETTINGS] [--p2 SETTINGS]
+// SETTINGS is an engine spec as in tournament for that side, with an
+// extra "noise=P" setting; without an engine name it is for negamax.
+int run_selfplay(int argc, char* argv[]) {
+  long long games = 1000;
+  int threads = thread::hardware_concurrency();
+  string prefix = "selfplay";
+  int shard_games = 10000;
+  int random_plies = 2;
+  uint64_t seed = 1;
+  SideConfig sides[2];
+  for (int s = 0; s < 2; ++s) parse_side_config("negamax:depth=6", &sides[s]);
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--games") {
+      games = atoll(value);
+    } else if (arg == "--threads") {
+      threads = atoi(value);
+    } else if (arg == "--out") {
+      prefix = value;
+    } else if (arg == "--shard-games") {
+      shard_games = atoi(value);
+    } else if (arg == "--random-plies") {
+      random_plies = atoi(value);
+    } else if (arg == "--seed") {
+      seed = strtoull(value, NULL, 10);
+    } else if ((arg == "--p1" || arg == "--p2") &&
+               parse_side_config(value, &sides[(arg == "--p1") ? 0 : 1])) {
+    } else {
+      cerr << "Invalid option " << arg << " " << value << endl;
+      return 1;
+    }
+  }
+  if (threads < 1) threads = 1;
+  if (shard_games < 1) shard_games = 1;
+
+  SelfPlay selfplay(sides, random_plies, seed, prefix, shard_games);
+  if (!selfplay.run(games, threads)) {
+    cerr << "Failed writing game records" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Plays a game between two engines from the given position, engines[0]
+// playing P1. An engine that returns an illegal move loses. Returns the
+// winner.
+char play_game(Board board, char player, Engine* engines[2],
+               const SearchLimits* limits[2]) {
+  int moves[32];
+  while (list_moves(board, player, moves) > 0) {
+    int side = (player == P1) ? 0 : 1;
+    Board copy = board;
+    int move = engines[side]->getMove(&copy, player, *limits[side]);
+    if (!board.canMove(player, move)) break;
+    board.play(POS_TO_X(move), POS_TO_Y(move), player);
+    player = OPPONENT(player);
+  }
+  return OPPONENT(player);
+}
+
+// Results of one engine against another over game pairs, each pair being
+// the same opening played with both colors. Isolation has no draws, so a
+// pair scores 0, 1/2 or 1 for the first engine.
+struct PairingStats {
+  long long pairs[3];
+
+  PairingStats() { pairs[0] = pairs[1] = pairs[2] = 0; }
+  long long count() const { return pairs[0] + pairs[1] + pairs[2]; }
+  double mean() const { return (pairs[1] * 0.5 + pairs[2]) / count(); }
+  // Variance of the score of one pair.
+  double variance() const {
+    double m = mean();
+    return (pairs[1] * 0.25 + pairs[2]) / count() - m * m;
+  }
+};
+
+double elo_to_score(double elo) {
+  return 1 / (1 + pow(10, -elo / 400));
+}
+
+double score_to_elo(double score) {
+  score = min(max(score, 1e-6), 1 - 1e-6);
+  return -400 * log10(1 / score - 1);
+}
+
+// Log likelihood ratio of elo1 against elo0 for the pair results, in the
+// normal approximation of the generalized SPRT.
+double sprt_llr(const PairingStats& stats, double elo0, double elo1) {
+  double var = stats.variance();
+  if (stats.count() < 2 || var <= 0) return 0;
+  double s0 = elo_to_score(elo0);
+  double s1 = elo_to_score(elo1);
+  return stats.count() * (s1 - s0) * (2 * stats.mean() - s0 - s1) / (2 * var);
+}
+
+// Plays every pairing of the engine variants over the same random
+// openings, each opening with colors swapped, on a pool of threads. With
+// two variants and SPRT bounds it stops as soon as the sequential
+// probability ratio test accepts either hypothesis.
+class Tournament {
+ public:
+  Tournament(const vector<EngineSpec>& specs, int random_plies, uint64_t seed)
+      : specs(specs), random_plies(random_plies), seed(seed), sprt(false),
+        next_job(0), finished(false) {
+    for (size_t i = 0; i < specs.size(); ++i) {
+      for (size_t j = i + 1; j < specs.size(); ++j) {
+        pairings.push_back(make_pair((int)i, (int)j));
+      }
+    }
+    stats.resize(pairings.size());
+  }
+  void setSprt(double elo0, double elo1, double alpha, double beta);
+  void run(long long pairs, int threads);
+
+ private:
+  vector<EngineSpec> specs;
+  vector<pair<int, int> > pairings;
+  int random_plies;
+  uint64_t seed;
+  bool sprt;
+  double elo0, elo1, lower_bound, upper_bound;
+  long long total_jobs;
+  atomic<long long> next_job;
+  atomic<bool> finished;
+  mutex stats_lock;
+  vector<PairingStats> stats;
+
+  void worker();
+  void report(bool final);
+};
+
+void Tournament::setSprt(double elo0, double elo1, double alpha, double beta) {
+  sprt = true;
+  this->elo0 = elo0;
+  this->elo1 = elo1;
+  lower_bound = log(beta / (1 - alpha));
+  upper_bound = log((1 - beta) / alpha);
+}
+
+void Tournament::run(long long pairs, int threads) {
+  total_jobs = pairs * pairings.size();
+  vector<thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(thread(&Tournament::worker, this));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+  report(true);
+}
+
+// Job i plays opening i / pairings with pairing i % pairings, so that
+// every pairing sees the same openings.
+void Tournament::worker() {
+  vector<Engine*> engines;
+  for (size_t i = 0; i < specs.size(); ++i) engines.push_back(make_engine(specs[i]));
+
+  while (!finished) {
+    long long job = next_job++;
+    if (job >= total_jobs) break;
+    int pairing = job % pairings.size();
+    mt19937_64 rng(seed * 0x9E3779B97F4A7C15ULL + job / pairings.size());
+    Board board;
+    vector<int> opening;
+    char player = random_opening(&board, random_plies, rng, &opening);
+
+    int a = pairings[pairing].first;
+    int b = pairings[pairing].second;
+    int points = 0;
+    for (int swap_colors = 0; swap_colors < 2; ++swap_colors) {
+      int first = swap_colors ? b : a;
+      int second = swap_colors ? a : b;
+      Engine* players[2] = {engines[first], engines[second]};
+      const SearchLimits* limits[2] = {&specs[first].limits, &specs[second].limits};
+      char winner = play_game(board, player, players, limits);
+      if ((winner == P1) == (first == a)) points++;
+    }
+
+    lock_guard<mutex> lock(stats_lock);
+    // Pairs still in flight when the SPRT stopped are dropped, so that the
+    // final report shows the stats the verdict was reached on.
+    if (finished) break;
+    stats[pairing].pairs[points]++;
+    long long done = stats[pairing].count();
+    if (sprt && !finished) {
+      double llr = sprt_llr(stats[pairing], elo0, elo1);
+      if (llr <= lower_bound || llr >= upper_bound) finished = true;
+    }
+    if (done % 100 == 0 || finished) report(false);
+  }
+  for (size_t i = 0; i < engines.size(); ++i) delete engines[i];
+}
+
+// Called with stats_lock held, or once the workers are done.
+void Tournament::report(bool final) {
+  for (size_t p = 0; p < pairings.size(); ++p) {
+    const PairingStats& st = stats[p];
+    long long n = st.count();
+    if (n == 0) continue;
+    double m = st.mean();
+    double margin = 1.96 * sqrt(max(st.variance(), 0.0) / n);
+    double elo = score_to_elo(m);
+    double low = score_to_elo(m - margin);
+    double high = score_to_elo(m + margin);
+    printf("%s vs %s: pairs %lld (+%lld =%lld -%lld) score %.1f%% elo %.1f "
+           "[%.1f, %.1f]", specs[pairings[p].first].text.c_str(),
+           specs[pairings[p].second].text.c_str(), n, st.pairs[2], st.pairs[1],
+           st.pairs[0], m * 100, elo, low, high);
+    if (sprt) {
+      double llr = sprt_llr(st, elo0, elo1);
+      printf(" LLR %.2f [%.2f, %.2f]", llr, lower_bound, upper_bound);
+      if (final) {
+        printf(" %s", (llr >= upper_bound) ? "H1 accepted" :
+               (llr <= lower_bound) ? "H0 accepted" : "inconclusive");
+      }
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+// tournament --engine SPEC --engine SPEC [--engine SPEC...] [--pairs N]
+//            [--threads N] [--random-plies N] [--seed N]
+//            [--sprt ELO0,ELO1[,ALPHA,BETA]]
+// SPRT needs exactly two engines, and tests the first against the second.
+int run_tournament(int argc, char* argv[]) {
+  vector<EngineSpec> specs;
+  long long pairs = 1000;
+  int threads = thread::hardware_concurrency();
+  int random_plies = 2;
+  uint64_t seed = 1;
+  double sprt[4] = {0, 0, 0.05, 0.05};
+  bool use_sprt = false;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++i];
+    EngineSpec spec;
+    if (arg == "--engine" && parse_engine_spec(value, &spec)) {
+      specs.push_back(spec);
+    } else if (arg == "--pairs") {
+      pairs = atoll(value);
+    } else if (arg == "--threads") {
+      threads = atoi(value);
+    } else if (arg == "--random-plies") {
+      random_plies = atoi(value);
+    } else if (arg == "--seed") {
+      seed = strtoull(value, NULL, 10);
+    } else if (arg == "--sprt" &&
+               sscanf(value, "%lf,%lf,%lf,%lf", &sprt[0], &sprt[1], &sprt[2],
+                      &sprt[3]) >= 2) {
+      use_sprt = true;
+    } else {
+      cerr << "Invalid option " << arg << " " << value << endl;
+      return 1;
+    }
+  }
+  if (specs.size() < 2 || (use_sprt && specs.size() != 2)) {
+    cerr << "Need two engines, or exactly two for SPRT" << endl;
+    return 1;
+  }
+  if (threads < 1) threads = 1;
+
+  Tournament tournament(specs, random_plies, seed);
+  if (use_sprt) tournament.setSprt(sprt[0], sprt[1], sprt[2], sprt[3]);
+  tournament.run(pairs, threads);
+  return 0;
+}
+
+// Reads every game record in the files into records. Returns false if a
+// file can't be read.
+bool read_records(const vector<string>& paths, vector<GameRecord>* records) {
+  for (size_t i = 0; i < paths.size(); ++i) {
+    ifstream file(paths[i].c_str(), ios::binary);
+    GameRecordReader reader(&file);
+    GameRecord record;
+    while (reader.read(&record)) records->push_back(record);
+    if (!file.is_open() || !reader.ok()) {
+      cerr << paths[i] << ": cannot read game records" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs fn(begin, end, thread index) over [0, count) split evenly across
+// threads.
+template <typename Fn>
+void parallel_for(long long count, int threads, Fn fn) {
+  vector<thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    long long begin = count * t / threads;
+    long long end = count * (t + 1) / threads;
+    workers.push_back(thread(fn, begin, end, t));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+}
+
+// A position from a game corpus for evaluation tuning: its features for
+// the side to move, and 1 if that side went on to win, 0 if it lost.
+struct TuningSample {
+  int features[NUM_FEATURES];
+  double result;
+};
+
+// Tunes WeightedScorer weights against game results, Texel style: the
+// predicted result of a position is sigmoid(k * eval) and the weights
+// minimize the mean squared error of the predictions. Since the eval is
+// linear in the weights, features are extracted once up front and the
+// loss and its gradient are computed in parallel over the samples.
+class EvalTuner {
+ public:
+  EvalTuner(int threads) : threads(threads), k(0.01) {}
+  void extract(const vector<GameRecord>& records);
+  // Picks the k that fits the current weights best.
+  void fitScale(const double* weights);
+  double loss(const double* weights, double* gradient);
+  // Adam gradient descent on the loss.
+  void gradientDescent(double* weights, int iterations, double rate);
+  // Tries moving each weight up and down by a step, halving the step when
+  // nothing improves.
+  void localSearch(double* weights, int iterations, double step);
+  size_t size() { return samples.size(); }
+  double scale() { return k; }
+
+ private:
+  int threads;
+  double k;
+  vector<TuningSample> samples;
+};
+
+void EvalTuner::extract(const vector<GameRecord>& records) {
+  vector<vector<TuningSample> > parts(threads);
+  parallel_for(records.size(), threads,
+               [&](long long begin, long long end, int t) {
+    WeightedScorer scorer;
+    for (long long r = begin; r < end; ++r) {
+      const GameRecord& record = records[r];
+      if (record.winner == EMPTY) continue;
+      Board board;
+      char player;
+      unpack_position(record.start, &board, &player);
+      for (size_t m = 0; m <= record.moves.size(); ++m) {
+        int ap_pos = (player == P1) ? board.p1 : board.p2;
+        // Placements and lost positions are never scored by the search.
+        if (board.p1 != 0 && board.p2 != 0 && !board.hasLost(ap_pos)) {
+          TuningSample sample;
+          scorer.features(&board, player, sample.features);
+          sample.result = (record.winner == player) ? 1 : 0;
+          parts[t].push_back(sample);
+        }
+        if (m == record.moves.size()) break;
+        int sq = record.moves[m];
+        board.play(sq / 5, sq % 5, player);
+        player = OPPONENT(player);
+      }
+    }
+  });
+  for (int t = 0; t < threads; ++t) {
+    samples.insert(samples.end(), parts[t].begin(), parts[t].end());
+  }
+}
+
+double EvalTuner::loss(const double* weights, double* gradient) {
+  vector<double> losses(threads, 0.0);
+  vector<vector<double> > gradients(threads, vector<double>(NUM_FEATURES, 0.0));
+  parallel_for(samples.size(), threads,
+               [&](long long begin, long long end, int t) {
+    double total = 0;
+    double* grad = gradients[t].data();
+    for (long long i = begin; i < end; ++i) {
+      const TuningSample& sample = samples[i];
+      double eval = 0;
+      for (int f = 0; f < NUM_FEATURES; ++f) eval += weights[f] * sample.features[f];
+      double p = 1 / (1 + exp(-k * eval));
+      double error = p - sample.result;
+      total += error * error;
+      if (gradient != NULL) {
+        double d = 2 * error * p * (1 - p) * k;
+        for (int f = 0; f < NUM_FEATURES; ++f) grad[f] += d * sample.features[f];
+      }
+    }
+    losses[t] = total;
+  });
+  double total = 0;
+  for (int t = 0; t < threads; ++t) total += losses[t];
+  double n = max((double)samples.size(), 1.0);
+  if (gradient != NULL) {
+    for (int f = 0; f < NUM_FEATURES; ++f) {
+      gradient[f] = 0;
+      for (int t = 0; t < threads; ++t) gradient[f] += gradients[t][f];
+      gradient[f] /= n;
+    }
+  }
+  return total / n;
+}
+
+void EvalTuner::fitScale(const double* weights) {
+  // The loss is unimodal in k, so a golden section search finds it.
+  double low = 1e-4;
+  double high = 1.0;
+  const double ratio = 0.618033988749895;
+  for (int i = 0; i < 40; ++i) {
+    double a = high - ratio * (high - low);
+    double b = low + ratio * (high - low);
+    k = a;
+    double loss_a = loss(weights, NULL);
+    k = b;
+    double loss_b = loss(weights, NULL);
+    if (loss_a < loss_b) {
+      high = b;
+    } else {
+      low = a;
+    }
+  }
+  k = (low + high) / 2;
+}
+
+void EvalTuner::gradientDescent(double* weights, int iterations, double rate) {
+  double m[NUM_FEATURES] = {0};
+  double v[NUM_FEATURES] = {0};
+  const double beta1 = 0.9, beta2 = 0.999, epsilon = 1e-12;
+  for (int it = 1; it <= iterations; ++it) {
+    double gradient[NUM_FEATURES];
+    double current = loss(weights, gradient);
+    for (int f = 0; f < NUM_FEATURES; ++f) {
+      m[f] = beta1 * m[f] + (1 - beta1) * gradient[f];
+      v[f] = beta2 * v[f] + (1 - beta2) * gradient[f] * gradient[f];
+      double m_hat = m[f] / (1 - pow(beta1, it));
+      double v_hat = v[f] / (1 - pow(beta2, it));
+      weights[f] -= rate * m_hat / (sqrt(v_hat) + epsilon);
+    }
+    if (it % 100 == 0) fprintf(stderr, "iteration %d loss %.6f\n", it, current);
+  }
+}
+
+void EvalTuner::localSearch(double* weights, int iterations, double step) {
+  double best = loss(weights, NULL);
+  for (int it = 1; it <= iterations && step > 1e-3; ++it) {
+    bool improved = false;
+    for (int f = 0; f < NUM_FEATURES; ++f) {
+      for (int sign = -1; sign <= 1; sign += 2) {
+        double old = weights[f];
+        weights[f] = old + sign * step;
+        double current = loss(weights, NULL);
+        if (current < best) {
+          best = current;
+          improved = true;
+          break;
+        }
+        weights[f] = old;
+      }
+    }
+    if (!improved) step /= 2;
+    fprintf(stderr, "pass %d loss %.6f step %g\n", it, best, step);
+  }
+}
+
+// tune [--method texel|local] [--iterations N] [--rate X] [--threads N]
+//      [--init FILE] [--out FILE] RECORDS...
+// Tunes WeightedScorer weights on the positions of the game records and
+// writes them to --out, weights.txt by default. --rate is the Adam step
+// for texel and the initial step for local search.
+int run_tune(int argc, char* argv[]) {
+  string method = "texel";
+  int iterations = 1000;
+  double rate = -1;
+  int threads = thread::hardware_concurrency();
+  string out = "weights.txt";
+  WeightedScorer scorer;
+  vector<string> paths;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg[0] != '-') {
+      paths.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--method") {
+      method = value;
+    } else if (arg == "--iterations") {
+      iterations = atoi(value);
+    } else if (arg == "--rate") {
+      rate = atof(value);
+    } else if (arg == "--threads") {
+      threads = atoi(value);
+    } else if (arg == "--out") {
+      out = value;
+    } else if (arg == "--init" && scorer.load(value)) {
+    } else {
+      cerr << "Invalid option " << arg << " " << value << endl;
+      return 1;
+    }
+  }
+  if (method != "texel" && method != "local") {
+    cerr << "Unknown method " << method << endl;
+    return 1;
+  }
+  if (threads < 1) threads = 1;
+
+  vector<GameRecord> records;
+  if (!read_records(paths, &records)) return 1;
+  long long start = monotonic_ns();
+  EvalTuner tuner(threads);
+  tuner.extract(records);
+  if (tuner.size() == 0) {
+    cerr << "No positions to tune on" << endl;
+    return 1;
+  }
+  tuner.fitScale(scorer.weights);
+  double initial = tuner.loss(scorer.weights, NULL);
+  if (method == "texel") {
+    tuner.gradientDescent(scorer.weights, iterations, (rate > 0) ? rate : 0.05);
+  } else {
+    tuner.localSearch(scorer.weights, iterations, (rate > 0) ? rate : 1.0);
+  }
+  double final_loss = tuner.loss(scorer.weights, NULL);
+  double elapsed = (monotonic_ns() - start) / 1e9;
+
+  printf("Games           : %zu\n", records.size());
+  printf("Positions       : %zu\n", tuner.size());
+  printf("Scale k         : %.6f\n", tuner.scale());
+  printf("Initial loss    : %.6f\n", initial);
+  printf("Final loss      : %.6f\n", final_loss);
+  printf("Total time (ms) : %lld\n", (long long)(elapsed * 1000));
+  for (int f = 0; f < NUM_FEATURES; ++f) {
+    printf("%-15s : %.3f\n", FEATURE_NAMES[f], scorer.weights[f]);
+  }
+  if (!scorer.save(out)) {
+    cerr << "Failed writing " << out << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Times scorer on every child of the positions, each evaluated from the
+// side to move after the move, and returns evaluations per second.
+// Incremental scorers go through the search hooks, the others see the
+// board with the moved token.
+double time_child_evals(Scorer* scorer, vector<pair<Board, char> >& positions,
+                        long long* checksum) {
+  long long evals = 0;
+  long long start = monotonic_ns();
+  for (size_t i = 0; i < positions.size(); ++i) {
+    Board& board = positions[i].first;
+    char player = positions[i].second;
+    MoveList list;
+    board.generateMoves(player, list);
+    scorer->setPosition(&board);
+    for (int m = 0; m < list.count; ++m) {
+      int from = board.makeMove(player, list.moves[m]);
+      scorer->makeMove(player, from, list.moves[m]);
+      *checksum += scorer->getScore(&board, OPPONENT(player));
+      scorer->unmakeMove(player, from, list.moves[m]);
+      board.unmakeMove(player, list.moves[m], from);
+      evals++;
+    }
+  }
+  double elapsed = (monotonic_ns() - start) / 1e9;
+  return (elapsed > 0) ? evals / elapsed : 0;
+}
+
+// evalbench [WEIGHTS]
+// Compares NeuralScorer with DijkstraScorer. Checks that the incremental
+// accumulators match a full refresh along random games, then times child
+// evaluations and the bench searches with each scorer. Without WEIGHTS
+// the network has random weights, which time the same.
+int run_evalbench(int argc, char* argv[]) {
+  NeuralScorer* neural = new NeuralScorer();
+  if (argc > 0 && !neural->load(argv[0])) {
+    cerr << argv[0] << ": cannot read network" << endl;
+    return 1;
+  }
+  if (argc == 0) neural->randomize(1);
+  NeuralScorer* fresh = new NeuralScorer();
+  fresh->setWeights(neural->getWeights());
+  DijkstraScorer dijkstra;
+
+  // Random games, checked move by move.
+  mt19937_64 rng(1);
+  vector<pair<Board, char> > positions;
+  long long checks = 0;
+  long long mismatches = 0;
+  for (int game = 0; game < 2000; ++game) {
+    Board board;
+    vector<int> moves;
+    char player = random_opening(&board, 0, rng, &moves);
+    neural->setPosition(&board);
+    int squares[32];
+    int count;
+    while ((count = list_moves(board, player, squares)) > 0) {
+      positions.push_back(make_pair(board, player));
+      int from = (player == P1) ? board.p1 : board.p2;
+      int to = squares[rng() % count];
+      board.play(POS_TO_X(to), POS_TO_Y(to), player);
+      neural->makeMove(player, from, to);
+      player = OPPONENT(player);
+      fresh->setPosition(&board);
+      for (char side = P1; side <= P2; ++side) {
+        checks++;
+        if (neural->getScore(&board, side) != fresh->getScore(&board, side)) mismatches++;
       }
-      DEBUG(printMove(depth, POS_TO_X(pos), POS_TO_Y(pos)));
-      cell = player;
-      int score = -1 * negamax(pp_pos, pos, depth+1, -beta, -alpha, NULL);
-      cell = 0;
-      if (score > best_score) {
-        best_score = score;
-        if (best_move != NULL) {
-            *best_move = pos;
+    }
+  }
+  printf("Positions       : %zu\n", positions.size());
+  printf("Refresh checks  : %lld, %lld mismatches\n", checks, mismatches);
+#ifdef __AVX2__
+  printf("Kernels         : avx2\n");
+#else
+  printf("Kernels         : scalar\n");
+#endif
+
+  long long checksum = 0;
+  printf("Evals/second    : dijkstra %.0f, neural %.0f\n",
+         time_child_evals(&dijkstra, positions, &checksum),
+         time_child_evals(neural, positions, &checksum));
+
+  int count = sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]);
+  Scorer* scorers[] = {&dijkstra, neural};
+  const char* names[] = {"dijkstra", "neural"};
+  for (int s = 0; s < 2; ++s) {
+    Negamax negamax(scorers[s]);
+    long long nodes = 0;
+    long long leaves = 0;
+    long long start = monotonic_ns();
+    for (int i = 0; i < count; ++i) {
+      Board board;
+      char player = setup_moves(board, BENCH_POSITIONS[i].moves);
+      negamax.getMove(&board, player, BENCH_POSITIONS[i].depth);
+      nodes += negamax.node_count;
+      leaves += negamax.depth_count;
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    printf("Bench %-9s : %lld nodes, %lld leaves, %lld ms, %.0f nodes/second\n",
+           names[s], nodes, leaves, (long long)(elapsed * 1000),
+           (elapsed > 0) ? nodes / elapsed : 0);
+  }
+  delete fresh;
+  delete neural;
+  return mismatches == 0 ? 0 : 1;
+}
+
+// Float kernels for training, n a multiple of 8.
+#ifdef __AVX2__
+inline void nn_faxpy(float* y, const float* x, float a, int n) {
+  __m256 scale = _mm256_set1_ps(a);
+  for (int i = 0; i < n; i += 8) {
+    __m256 product = _mm256_mul_ps(_mm256_loadu_ps(x + i), scale);
+    _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), product));
+  }
+}
+
+inline float nn_fdot(const float* x, const float* y, int n) {
+  __m256 sum = _mm256_setzero_ps();
+  for (int i = 0; i < n; i += 8) {
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  return _mm_cvtss_f32(half);
+}
+#else
+inline void nn_faxpy(float* y, const float* x, float a, int n) {
+  for (int i = 0; i < n; ++i) y[i] += a * x[i];
+}
+
+inline float nn_fdot(const float* x, const float* y, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; ++i) sum += x[i] * y[i];
+  return sum;
+}
+#endif
+
+// A position for network training: the active features of the side to
+// move's token and of the opponent's, and the target win probability.
+struct TrainingSample {
+  PackedPosition position;
+  uint16_t features[2][26];
+  uint8_t counts[2];
+  float target;
+};
+
+// Offsets of the float parameters of the network, in NetworkWeights order.
+const int TP_FT_WEIGHTS = 0;
+const int TP_FT_BIAS = TP_FT_WEIGHTS + NN_FEATURES * NN_HIDDEN;
+const int TP_L1_WEIGHTS = TP_FT_BIAS + NN_HIDDEN;
+const int TP_L1_BIAS = TP_L1_WEIGHTS + NN_L1 * 2 * NN_HIDDEN;
+const int TP_L2_WEIGHTS = TP_L1_BIAS + NN_L1;
+const int TP_L2_BIAS = TP_L2_WEIGHTS + NN_L1;
+const int TP_COUNT = TP_L2_BIAS + 1;
+
+// Trains the NeuralScorer network in float with mini-batch Adam, on the
+// squared error between sigmoid(output) and the targets. Batches are split
+// across threads, each summing gradients into its own buffer. Layer
+// weights are kept within what NetworkWeights can hold.
+class NetworkTrainer {
+ public:
+  NetworkTrainer(int threads, uint64_t seed);
+  // Replays the games and labels their positions with the result for the
+  // side to move, mixed by lambda with the sigmoid of a search score. The
+  // last validation fraction of the games are kept for validation.
+  void label(const vector<GameRecord>& records, int search_depth, double lambda,
+             double validation);
+  // Runs an epoch and returns the mean training loss.
+  double trainEpoch(int batch_size, double rate);
+  double loss(const vector<TrainingSample>& set);
+  // Mean loss of the exported network on the validation set.
+  double quantizedLoss(const NetworkWeights& weights);
+  void quantize(NetworkWeights* weights);
+
+  vector<TrainingSample> train;
+  vector<TrainingSample> validation;
+
+ private:
+  struct Activations {
+    float accumulator[2 * NN_HIDDEN];
+    float input[2 * NN_HIDDEN];
+    float hidden_sum[NN_L1];
+    float hidden[NN_L1];
+  };
+
+  int threads;
+  mt19937_64 rng;
+  vector<float> params;
+  vector<float> adam_m;
+  vector<float> adam_v;
+  long long steps;
+
+  float forward(const TrainingSample& sample, Activations* a);
+  // Adds the gradient of the sample's loss to gradient and returns the loss.
+  float backward(const TrainingSample& sample, float* gradient);
+};
+
+NetworkTrainer::NetworkTrainer(int threads, uint64_t seed)
+    : threads(threads), rng(seed), params(TP_COUNT, 0.0f),
+      adam_m(TP_COUNT, 0.0f), adam_v(TP_COUNT, 0.0f), steps(0) {
+  uniform_real_distribution<float> ft(-0.05f, 0.05f);
+  uniform_real_distribution<float> l1(-0.25f, 0.25f);
+  uniform_real_distribution<float> l2(-0.5f, 0.5f);
+  for (int i = TP_FT_WEIGHTS; i < TP_FT_BIAS; ++i) params[i] = ft(rng);
+  for (int i = TP_FT_BIAS; i < TP_L1_WEIGHTS; ++i) params[i] = 0.25f;
+  for (int i = TP_L1_WEIGHTS; i < TP_L1_BIAS; ++i) params[i] = l1(rng);
+  for (int i = TP_L2_WEIGHTS; i < TP_L2_BIAS; ++i) params[i] = l2(rng);
+}
+
+void NetworkTrainer::label(const vector<GameRecord>& records, int search_depth,
+                           double lambda, double validation_fraction) {
+  size_t first_validation = (size_t)(records.size() * (1 - validation_fraction));
+  vector<vector<TrainingSample> > parts(threads);
+  vector<vector<TrainingSample> > validation_parts(threads);
+  parallel_for(records.size(), threads,
+               [&](long long begin, long long end, int t) {
+    Negamax negamax;
+    SearchLimits limits;
+    limits.depth = search_depth;
+    for (long long r = begin; r < end; ++r) {
+      const GameRecord& record = records[r];
+      if (record.winner == EMPTY) continue;
+      vector<TrainingSample>& out =
+          (r >= (long long)first_validation) ? validation_parts[t] : parts[t];
+      Board board;
+      char player;
+      unpack_position(record.start, &board, &player);
+      for (size_t m = 0; m <= record.moves.size(); ++m) {
+        int ap_pos = (player == P1) ? board.p1 : board.p2;
+        if (board.p1 != 0 && board.p2 != 0 && !board.hasLost(ap_pos)) {
+          TrainingSample sample;
+          sample.position = pack_position(board, player);
+          PackedPosition packed = sample.position;
+          uint32_t occupancy = packed & ((1 << 25) - 1);
+          int pp_pos = (player == P1) ? board.p2 : board.p1;
+          int own = POS_TO_SQ(ap_pos);
+          int other = POS_TO_SQ(pp_pos);
+          sample.counts[0] = nn_active_features(occupancy, own, other, sample.features[0]);
+          sample.counts[1] = nn_active_features(occupancy, other, own, sample.features[1]);
+          double target = (record.winner == player) ? 1 : 0;
+          if (search_depth > 0 && lambda > 0) {
+            SearchResult result;
+            negamax.getMove(&board, player, limits, &result);
+            int score = min(max(result.score, -800), 800);
+            double search = 1 / (1 + exp(-(double)score / NN_OUTPUT_SCALE));
+            target = lambda * search + (1 - lambda) * target;
+          }
+          sample.target = target;
+          out.push_back(sample);
         }
-      }
-      alpha = (alpha >= score) ? alpha : score;
-      if (alpha >= beta) {
-        DEBUG(printDebug(depth, "BEST", best_score));
-        return best_score;
+        if (m == record.moves.size()) break;
+        int sq = record.moves[m];
+        board.play(sq / 5, sq % 5, player);
+        player = OPPONENT(player);
       }
     }
+  });
+  for (int t = 0; t < threads; ++t) {
+    train.insert(train.end(), parts[t].begin(), parts[t].end());
+    validation.insert(validation.end(), validation_parts[t].begin(),
+                      validation_parts[t].end());
   }
-  DEBUG(printDebug(depth, "BEST", best_score));
-  return best_score;
 }
 
-void Board::printPossibleMoves(char player) {
-  int ap_pos = (player == P1) ? p1 : p2;
+float NetworkTrainer::forward(const TrainingSample& sample, Activations* a) {
+  const float* p = params.data();
+  for (int side = 0; side < 2; ++side) {
+    float* acc = a->accumulator + side * NN_HIDDEN;
+    memcpy(acc, p + TP_FT_BIAS, NN_HIDDEN * sizeof(float));
+    for (int i = 0; i < sample.counts[side]; ++i) {
+      nn_faxpy(acc, p + TP_FT_WEIGHTS + sample.features[side][i] * NN_HIDDEN, 1.0f, NN_HIDDEN);
+    }
+  }
+  for (int i = 0; i < 2 * NN_HIDDEN; ++i) {
+    a->input[i] = min(max(a->accumulator[i], 0.0f), 1.0f);
+  }
+  float output = p[TP_L2_BIAS];
+  for (int j = 0; j < NN_L1; ++j) {
+    a->hidden_sum[j] = p[TP_L1_BIAS + j] +
+        nn_fdot(p + TP_L1_WEIGHTS + j * 2 * NN_HIDDEN, a->input, 2 * NN_HIDDEN);
+    a->hidden[j] = min(max(a->hidden_sum[j], 0.0f), 1.0f);
+    output += p[TP_L2_WEIGHTS + j] * a->hidden[j];
+  }
+  return output;
+}
 
-  char brd[49];
-  for (int i = 0; i < 49; ++i) {
-    brd[i] = board[i];
+float NetworkTrainer::backward(const TrainingSample& sample, float* gradient) {
+  const float* p = params.data();
+  Activations a;
+  float output = forward(sample, &a);
+  float predicted = 1 / (1 + exp(-output));
+  float error = predicted - sample.target;
+  float d_output = 2 * error * predicted * (1 - predicted);
+
+  float d_input[2 * NN_HIDDEN];
+  memset(d_input, 0, sizeof(d_input));
+  gradient[TP_L2_BIAS] += d_output;
+  for (int j = 0; j < NN_L1; ++j) {
+    gradient[TP_L2_WEIGHTS + j] += d_output * a.hidden[j];
+    if (a.hidden_sum[j] <= 0 || a.hidden_sum[j] >= 1) continue;
+    float d_hidden = d_output * p[TP_L2_WEIGHTS + j];
+    gradient[TP_L1_BIAS + j] += d_hidden;
+    nn_faxpy(gradient + TP_L1_WEIGHTS + j * 2 * NN_HIDDEN, a.input, d_hidden, 2 * NN_HIDDEN);
+    nn_faxpy(d_input, p + TP_L1_WEIGHTS + j * 2 * NN_HIDDEN, d_hidden, 2 * NN_HIDDEN);
+  }
+  for (int i = 0; i < 2 * NN_HIDDEN; ++i) {
+    if (a.accumulator[i] <= 0 || a.accumulator[i] >= 1) d_input[i] = 0;
+  }
+  for (int side = 0; side < 2; ++side) {
+    const float* d_acc = d_input + side * NN_HIDDEN;
+    nn_faxpy(gradient + TP_FT_BIAS, d_acc, 1.0f, NN_HIDDEN);
+    for (int i = 0; i < sample.counts[side]; ++i) {
+      nn_faxpy(gradient + TP_FT_WEIGHTS + sample.features[side][i] * NN_HIDDEN, d_acc,
+               1.0f, NN_HIDDEN);
+    }
   }
+  return error * error;
+}
 
-  for (int i = 0; i < 8; ++i) {
-    int pos = ap_pos;
-    int move = MOVES[i];
-    while (true) {
-      pos += move;
-      char& cell = brd[pos];
-      if (cell != EMPTY) {
-        break;
+double NetworkTrainer::trainEpoch(int batch_size, double rate) {
+  shuffle(train.begin(), train.end(), rng);
+  vector<vector<float> > gradients(threads, vector<float>(TP_COUNT));
+  vector<double> losses(threads);
+  double total = 0;
+  const float beta1 = 0.9f, beta2 = 0.999f, epsilon = 1e-8f;
+  const float weight_limit = 127.0f / NN_QB;
+  for (size_t first = 0; first < train.size(); first += batch_size) {
+    size_t count = min((size_t)batch_size, train.size() - first);
+    parallel_for(count, threads, [&](long long begin, long long end, int t) {
+      float* gradient = gradients[t].data();
+      memset(gradient, 0, TP_COUNT * sizeof(float));
+      double sum = 0;
+      for (long long i = begin; i < end; ++i) sum += backward(train[first + i], gradient);
+      losses[t] = sum;
+    });
+    steps++;
+    float correction1 = 1 - pow(beta1, steps);
+    float correction2 = 1 - pow(beta2, steps);
+    for (int i = 0; i < TP_COUNT; ++i) {
+      float g = 0;
+      for (int t = 0; t < threads; ++t) g += gradients[t][i];
+      g /= count;
+      // Features that were not in the batch have no gradient; skip them
+      // rather than decaying their moments.
+      if (g == 0) continue;
+      adam_m[i] = beta1 * adam_m[i] + (1 - beta1) * g;
+      adam_v[i] = beta2 * adam_v[i] + (1 - beta2) * g * g;
+      params[i] -= rate * (adam_m[i] / correction1) / (sqrt(adam_v[i] / correction2) + epsilon);
+    }
+    for (int i = TP_L1_WEIGHTS; i < TP_L1_BIAS; ++i) {
+      params[i] = min(max(params[i], -weight_limit), weight_limit);
+    }
+    for (int i = TP_L2_WEIGHTS; i < TP_L2_BIAS; ++i) {
+      params[i] = min(max(params[i], -weight_limit), weight_limit);
+    }
+    for (int t = 0; t < threads; ++t) total += losses[t];
+  }
+  return total / max((size_t)1, train.size());
+}
+
+double NetworkTrainer::loss(const vector<TrainingSample>& set) {
+  vector<double> losses(threads);
+  parallel_for(set.size(), threads, [&](long long begin, long long end, int t) {
+    double sum = 0;
+    for (long long i = begin; i < end; ++i) {
+      Activations a;
+      float predicted = 1 / (1 + exp(-forward(set[i], &a)));
+      sum += (predicted - set[i].target) * (predicted - set[i].target);
+    }
+    losses[t] = sum;
+  });
+  double total = 0;
+  for (int t = 0; t < threads; ++t) total += losses[t];
+  return total / max((size_t)1, set.size());
+}
+
+double NetworkTrainer::quantizedLoss(const NetworkWeights& weights) {
+  NeuralScorer* scorer = new NeuralScorer();
+  scorer->setWeights(weights);
+  double total = 0;
+  for (size_t i = 0; i < validation.size(); ++i) {
+    Board board;
+    char player;
+    unpack_position(validation[i].position, &board, &player);
+    scorer->setPosition(&board);
+    double score = scorer->getScore(&board, player);
+    double predicted = 1 / (1 + exp(-score / NN_OUTPUT_SCALE));
+    total += (predicted - validation[i].target) * (predicted - validation[i].target);
+  }
+  delete scorer;
+  return total / max((size_t)1, validation.size());
+}
+
+void NetworkTrainer::quantize(NetworkWeights* weights) {
+  const float* p = params.data();
+  for (int f = 0; f < NN_FEATURES; ++f) {
+    for (int i = 0; i < NN_HIDDEN; ++i) {
+      weights->ft_weights[f][i] = lround(p[TP_FT_WEIGHTS + f * NN_HIDDEN + i] * NN_QA);
+    }
+  }
+  for (int i = 0; i < NN_HIDDEN; ++i) weights->ft_bias[i] = lround(p[TP_FT_BIAS + i] * NN_QA);
+  for (int j = 0; j < NN_L1; ++j) {
+    for (int i = 0; i < 2 * NN_HIDDEN; ++i) {
+      weights->l1_weights[j][i] = lround(p[TP_L1_WEIGHTS + j * 2 * NN_HIDDEN + i] * NN_QB);
+    }
+    weights->l1_bias[j] = lround(p[TP_L1_BIAS + j] * NN_QA * NN_QB);
+    weights->l2_weights[j] = lround(p[TP_L2_WEIGHTS + j] * NN_QB);
+  }
+  weights->l2_bias = lround(p[TP_L2_BIAS] * NN_QA * NN_QB);
+}
+
+// train [--epochs N] [--batch N] [--rate X] [--threads N] [--depth N]
+//       [--lambda X] [--validation X] [--seed N] [--out FILE] RECORDS...
+// Trains a network for scorer=neural:FILE on the positions of the game
+// records and writes it to --out, network.nn by default. Targets mix the
+// game result with a --depth search score by --lambda; --depth 0 trains on
+// results only.
+int run_train(int argc, char* argv[]) {
+  int epochs = 20;
+  int batch_size = 1024;
+  double rate = 0.005;
+  int threads = thread::hardware_concurrency();
+  int depth = 4;
+  double lambda = 0.5;
+  double validation = 0.1;
+  uint64_t seed = 1;
+  string out = "network.nn";
+  vector<string> paths;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg[0] != '-') {
+      paths.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--epochs") {
+      epochs = atoi(value);
+    } else if (arg == "--batch") {
+      batch_size = max(1, atoi(value));
+    } else if (arg == "--rate") {
+      rate = atof(value);
+    } else if (arg == "--threads") {
+      threads = atoi(value);
+    } else if (arg == "--depth") {
+      depth = atoi(value);
+    } else if (arg == "--lambda") {
+      lambda = atof(value);
+    } else if (arg == "--validation") {
+      validation = atof(value);
+    } else if (arg == "--seed") {
+      seed = strtoull(value, NULL, 10);
+    } else if (arg == "--out") {
+      out = value;
+    } else {
+      cerr << "Invalid option " << arg << " " << value << endl;
+      return 1;
+    }
+  }
+  if (threads < 1) threads = 1;
+
+  vector<GameRecord> records;
+  if (!read_records(paths, &records)) return 1;
+  NetworkTrainer trainer(threads, seed);
+  long long start = monotonic_ns();
+  trainer.label(records, depth, lambda, validation);
+  if (trainer.train.empty()) {
+    cerr << "No positions to train on" << endl;
+    return 1;
+  }
+  printf("Positions       : %zu training, %zu validation, labelled in %lld ms\n",
+         trainer.train.size(), trainer.validation.size(),
+         (monotonic_ns() - start) / 1000000);
+
+  for (int epoch = 1; epoch <= epochs; ++epoch) {
+    long long epoch_start = monotonic_ns();
+    double train_loss = trainer.trainEpoch(batch_size, rate);
+    double elapsed = (monotonic_ns() - epoch_start) / 1e9;
+    printf("Epoch %3d       : train loss %.6f, validation loss %.6f, %.0f positions/s\n",
+           epoch, train_loss, trainer.loss(trainer.validation),
+           (elapsed > 0) ? trainer.train.size() / elapsed : 0);
+    fflush(stdout);
+  }
+
+  NetworkWeights* weights = new NetworkWeights();
+  trainer.quantize(weights);
+  printf("Quantized loss  : %.6f validation\n", trainer.quantizedLoss(*weights));
+  bool saved = save_network(out, *weights);
+  delete weights;
+  if (!saved) {
+    cerr << "Failed writing " << out << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// prunetest SETTINGS [--base SETTINGS] [--positions N] [--depth N]
+//           [--iterate] [--seed N] [--scorer NAME]
+// Searches random positions at a fixed depth with the default search, or
+// the --base search options, and with the search options in SETTINGS (e.g.
+// "futility=1,razoring=1"), and reports the nodes each took, the nodes
+// pruned and how often the options changed the best move or the score.
+// --iterate deepens both searches iteratively.
+int run_prunetest(int argc, char* argv[]) {
+  SearchOptions options;
+  SearchOptions base;
+  bool iterate = false;
+  int positions = 200;
+  int depth = 8;
+  uint64_t seed = 1;
+  string scorer_name = "dijkstra";
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--iterate") {
+      iterate = true;
+      continue;
+    }
+    if (arg[0] != '-' || (arg == "--base" && i + 1 < argc)) {
+      SearchOptions* target = &options;
+      if (arg == "--base") {
+        target = &base;
+        arg = argv[++i];
+      }
+      map<string, string> settings;
+      bool valid = parse_settings(arg, &settings);
+      for (map<string, string>::iterator it = settings.begin();
+           valid && it != settings.end(); ++it) {
+        valid = set_search_option(it->first, it->second, target);
       }
-      cell = 3;
+      if (!valid) {
+        cerr << "Invalid search options " << arg << endl;
+        return 1;
+      }
+      continue;
+    }
+    if (i + 1 >= argc) {
+      cerr << "Missing value for " << arg << endl;
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--positions") {
+      positions = atoi(value);
+    } else if (arg == "--depth") {
+      depth = atoi(value);
+    } else if (arg == "--seed") {
+      seed = strtoull(value, NULL, 10);
+    } else if (arg == "--scorer") {
+      scorer_name = value;
+    } else {
+      cerr << "Invalid option " << arg << " " << value << endl;
+      return 1;
     }
   }
-  for (int i=1; i<6; ++i) {
-    cout << "| ";
-    for (int j=1; j<6; ++j) {
-      char cell = brd[i*7+j];
-      if (cell == 0) {
-        cout << "  | "; 
-      } else {
-        if (p1 == i*7+j || p2 == i*7+j) {
-          cout << PLAYER(cell) << " | ";
-        } else if (cell == 3) {
-          cout << "* | ";
-        } else {
-          cout << "X | ";
-        }
+  Scorer* scorer = make_scorer(scorer_name);
+  if (scorer == NULL) {
+    cerr << "Unknown scorer " << scorer_name << endl;
+    return 1;
+  }
+
+  Negamax reference(scorer);
+  Negamax pruned(scorer);
+  reference.setOptions(base);
+  pruned.setOptions(options);
+  mt19937_64 rng(seed);
+  long long reference_nodes = 0, pruned_nodes = 0;
+  long long reference_ns = 0, pruned_ns = 0;
+  long long futility_prunes = 0, razor_prunes = 0, reductions = 0;
+  long long reference_passes = 0, passes = 0;
+  int searched = 0, moves_changed = 0, scores_changed = 0;
+  long long score_error = 0;
+  int squares[32];
+  while (searched < positions) {
+    Board board;
+    vector<int> moves;
+    char player = random_opening(&board, rng() % 12, rng, &moves);
+    if (list_moves(board, player, squares) == 0) continue;
+    SearchLimits limits;
+    limits.depth = depth;
+    limits.iterate = iterate;
+    SearchResult expected, result;
+    long long start = monotonic_ns();
+    reference.getMove(&board, player, limits, &expected);
+    long long middle = monotonic_ns();
+    pruned.getMove(&board, player, limits, &result);
+    reference_ns += middle - start;
+    pruned_ns += monotonic_ns() - middle;
+    reference_nodes += reference.node_count;
+    pruned_nodes += pruned.node_count;
+    futility_prunes += pruned.futility_prunes;
+    razor_prunes += pruned.razor_prunes;
+    reductions += pruned.lmr_reductions;
+    reference_passes += reference.mtdf_passes;
+    passes += pruned.mtdf_passes;
+    if (result.move != expected.move) moves_changed++;
+    if (result.score != expected.score) scores_changed++;
+    score_error += abs(result.score - expected.score);
+    searched++;
+  }
+  printf("Positions       : %d at depth %d\n", searched, depth);
+  printf("Nodes           : %lld base, %lld with options (%.1f%%)\n",
+         reference_nodes, pruned_nodes,
+         100.0 * pruned_nodes / max(1LL, reference_nodes));
+  printf("Time (ms)       : %lld base, %lld with options\n",
+         reference_ns / 1000000, pruned_ns / 1000000);
+  if (base.mtdf || options.mtdf) {
+    printf("MTD(f) passes   : %lld base, %lld with options\n", reference_passes,
+           passes);
+  }
+  printf("Pruned          : %lld futility, %lld razoring, %lld reductions\n",
+         futility_prunes, razor_prunes, reductions);
+  printf("Best move       : changed in %d positions (%.1f%%)\n", moves_changed,
+         100.0 * moves_changed / max(1, searched));
+  printf("Score           : changed in %d positions, mean error %.2f\n",
+         scores_changed, (double)score_error / max(1, searched));
+  delete scorer;
+  return 0;
+}
+
+// Proof and disproof numbers at or above this are infinite.
+const uint32_t PN_INFINITY = 1U << 30;
+
+// A position in the proof number table: phi and delta are the proof and
+// disproof numbers of a win for the side to move, and work is the nodes
+// spent on it, which decides what gets replaced.
+struct ProofEntry {
+  uint64_t key;
+  uint32_t phi;
+  uint32_t delta;
+  uint32_t work;
+  uint32_t unused;
+};
+
+// Depth first proof number search (df-pn) of whether the side to move
+// wins, in the negamax form: a position's proof number is the smallest
+// disproof number of its children, and its disproof number the sum of
+// their proof numbers. Numbers live in a fixed size table of four entry
+// buckets, so memory stays bounded; the least worked entries are replaced
+// first, and a position not in the table counts as 1, 1.
+class ProofSearch {
+ public:
+  ProofSearch(int hash_mb, long long node_budget);
+  // Returns the winner, or EMPTY if the node budget ran out first.
+  char prove(const Board& board, char player);
+  // Prints the proof tree of the last proven position to depth plies: one
+  // winning move of the winner and every reply of the loser.
+  void printTree(ostream& out, int depth);
+  // Returns a winning move of the last proven position, or 0.
+  int winningMove();
+  // Nodes searched by the last prove(), printTree() included.
+  long long node_count;
+
+ private:
+  vector<ProofEntry> table;
+  uint64_t table_mask;
+  long long node_budget;
+  bool aborted;
+  Board board;
+  char root_player;
+  uint64_t hash;
+
+  void lookup(uint64_t key, uint32_t* phi, uint32_t* delta);
+  void store(uint64_t key, uint32_t phi, uint32_t delta, long long work);
+  uint64_t childKey(char player, int pos);
+  void play(char player, int pos, int* from);
+  void undo(char player, int pos, int from);
+  void mid(char player, uint32_t phi_limit, uint32_t delta_limit);
+  // Proves the child if the table has lost it, and returns its numbers.
+  void childNumbers(char player, int pos, uint32_t* phi, uint32_t* delta);
+  void printNode(ostream& out, char player, int ply, int depth);
+};
+
+ProofSearch::ProofSearch(int hash_mb, long long node_budget)
+    : node_count(0), node_budget(node_budget), aborted(false), root_player(P1),
+      hash(0) {
+  uint64_t count = 4;
+  while (count * 2 * sizeof(ProofEntry) <= (uint64_t)hash_mb << 20) count *= 2;
+  table.assign(count, ProofEntry());
+  table_mask = count / 4 - 1;
+}
+
+void ProofSearch::lookup(uint64_t key, uint32_t* phi, uint32_t* delta) {
+  const ProofEntry* bucket = &table[(key & table_mask) * 4];
+  for (int i = 0; i < 4; ++i) {
+    if (bucket[i].key == key && bucket[i].work != 0) {
+      *phi = bucket[i].phi;
+      *delta = bucket[i].delta;
+      return;
+    }
+  }
+  *phi = 1;
+  *delta = 1;
+}
+
+void ProofSearch::store(uint64_t key, uint32_t phi, uint32_t delta, long long work) {
+  ProofEntry* bucket = &table[(key & table_mask) * 4];
+  ProofEntry* replace = &bucket[0];
+  for (int i = 0; i < 4; ++i) {
+    if (bucket[i].key == key) {
+      replace = &bucket[i];
+      break;
+    }
+    if (bucket[i].work < replace->work) replace = &bucket[i];
+  }
+  replace->key = key;
+  replace->phi = phi;
+  replace->delta = delta;
+  replace->work = (uint32_t)min(max(work, 1LL), 0xFFFFFFFFLL);
+}
+
+uint64_t ProofSearch::childKey(char player, int pos) {
+  int token = (player == P1) ? board.p1 : board.p2;
+  int from_sq = (token != 0) ? POS_TO_SQ(token) : 25;
+  int to_sq = POS_TO_SQ(pos);
+  return hash ^ ZOBRIST_CELL[to_sq] ^ ZOBRIST_SIDE ^
+      ZOBRIST_TOKEN[player - 1][from_sq] ^ ZOBRIST_TOKEN[player - 1][to_sq];
+}
+
+void ProofSearch::play(char player, int pos, int* from) {
+  hash = childKey(player, pos);
+  *from = board.makeMove(player, pos);
+}
+
+void ProofSearch::undo(char player, int pos, int from) {
+  board.unmakeMove(player, pos, from);
+  // Keys are xor differences, so the same key undoes the move.
+  hash ^= ZOBRIST_CELL[POS_TO_SQ(pos)] ^ ZOBRIST_SIDE ^
+      ZOBRIST_TOKEN[player - 1][(from != 0) ? POS_TO_SQ(from) : 25] ^
+      ZOBRIST_TOKEN[player - 1][POS_TO_SQ(pos)];
+}
+
+void ProofSearch::mid(char player, uint32_t phi_limit, uint32_t delta_limit) {
+  node_count++;
+  if (node_count >= node_budget) aborted = true;
+  long long start = node_count;
+  MoveList list;
+  board.generateMoves(player, list);
+  int* moves = list.moves;
+  int count = list.count;
+  if (count == 0) {
+    store(hash, PN_INFINITY, 0, 1);
+    return;
+  }
+  uint64_t keys[MAX_MOVES];
+  for (int i = 0; i < count; ++i) keys[i] = childKey(player, moves[i]);
+
+  while (true) {
+    uint32_t phi = PN_INFINITY;
+    uint32_t delta = 0;
+    uint32_t second_delta = PN_INFINITY;
+    uint32_t best_phi = 0;
+    int best = 0;
+    for (int i = 0; i < count; ++i) {
+      uint32_t child_phi, child_delta;
+      lookup(keys[i], &child_phi, &child_delta);
+      delta = min(delta + child_phi, PN_INFINITY);
+      if (child_delta < phi) {
+        second_delta = phi;
+        phi = child_delta;
+        best = i;
+        best_phi = child_phi;
+      } else if (child_delta < second_delta) {
+        second_delta = child_delta;
       }
     }
-    cout << endl;
+    if (phi >= phi_limit || delta >= delta_limit || aborted) {
+      store(hash, phi, delta, node_count - start + 1);
+      return;
+    }
+    // The child is searched until its disproof number passes the next
+    // best one, or the sum of proof numbers passes this node's limit.
+    uint32_t child_phi_limit = (uint32_t)min((long long)delta_limit - delta + best_phi,
+                                             (long long)PN_INFINITY);
+    uint32_t child_delta_limit = min(phi_limit, second_delta + 1);
+    int from;
+    play(player, moves[best], &from);
+    mid(OPPONENT(player), child_phi_limit, child_delta_limit);
+    undo(player, moves[best], from);
   }
 }
 
-void play_match(char player, Board& board);
- 
-int main(int argc, char* argv[]) {
-  for (int i = 0; i < 5; ++i) {
-    for (int j = 0; j < 5; ++j) {
-      if (i == 0 && j == 0) continue;
+char ProofSearch::prove(const Board& position, char player) {
+  init_zobrist();
+  board = position;
+  root_player = player;
+  hash = zobrist_key(board, player);
+  node_count = 0;
+  aborted = false;
+  mid(player, PN_INFINITY, PN_INFINITY);
+  uint32_t phi, delta;
+  lookup(hash, &phi, &delta);
+  if (phi == 0) return player;
+  if (delta == 0) return OPPONENT(player);
+  return EMPTY;
+}
+
+void ProofSearch::childNumbers(char player, int pos, uint32_t* phi, uint32_t* delta) {
+  int from;
+  play(player, pos, &from);
+  lookup(hash, phi, delta);
+  if (*phi != 0 && *delta != 0 && !aborted) {
+    mid(OPPONENT(player), PN_INFINITY, PN_INFINITY);
+    lookup(hash, phi, delta);
+  }
+  undo(player, pos, from);
+}
+
+int ProofSearch::winningMove() {
+  uint32_t phi, delta;
+  lookup(hash, &phi, &delta);
+  if (phi != 0) return 0;
+  MoveList list;
+  board.generateMoves(root_player, list);
+  int* moves = list.moves;
+  int count = list.count;
+  // The proof left a lost child in the table, unless it was replaced since.
+  for (int i = 0; i < count; ++i) {
+    uint32_t child_phi, child_delta;
+    int from;
+    play(root_player, moves[i], &from);
+    lookup(hash, &child_phi, &child_delta);
+    undo(root_player, moves[i], from);
+    if (child_delta == 0) return moves[i];
+  }
+  // Only then are the children proven again, on a budget of their own.
+  long long budget = node_budget;
+  node_budget = node_count + budget;
+  aborted = false;
+  int move = 0;
+  for (int i = 0; i < count && move == 0; ++i) {
+    uint32_t child_phi, child_delta;
+    childNumbers(root_player, moves[i], &child_phi, &child_delta);
+    if (child_delta == 0) move = moves[i];
+  }
+  node_budget = budget;
+  return move;
+}
+
+void ProofSearch::printTree(ostream& out, int depth) {
+  printNode(out, root_player, 0, depth);
+}
+
+void ProofSearch::printNode(ostream& out, char player, int ply, int depth) {
+  if (ply >= depth) return;
+  uint32_t phi, delta;
+  lookup(hash, &phi, &delta);
+  MoveList list;
+  board.generateMoves(player, list);
+  int* moves = list.moves;
+  int count = list.count;
+  for (int i = 0; i < count; ++i) {
+    uint32_t child_phi, child_delta;
+    childNumbers(player, moves[i], &child_phi, &child_delta);
+    // A won position needs one move to a lost child; a lost one all moves.
+    if (phi == 0 && child_delta != 0) continue;
+    out << string(2 * ply + 2, ' ') << PLAYER(player) << " "
+        << square_name(moves[i]) << '\n';
+    int from;
+    play(player, moves[i], &from);
+    printNode(out, OPPONENT(player), ply + 1, depth);
+    undo(player, moves[i], from);
+    if (phi == 0) break;
+  }
+}
+
+// prove [--nodes N] [--hash-mb N] [--tree DEPTH] [--openings | FILE]
+// Proves positions won or lost for the side to move with df-pn, one per
+// line of FILE or stdin in the notation of analyze, or the 24 openings of
+// the default sweep. Prints the winner, a winning move and the nodes
+// searched, and with --tree the proof tree to DEPTH plies. Positions that
+// need more than --nodes nodes are reported as unknown.
+int run_prove(int argc, char* argv[]) {
+  long long nodes = 100000000;
+  int hash_mb = 64;
+  int tree_depth = 0;
+  bool openings = false;
+  const char* path = NULL;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--nodes" && i + 1 < argc) {
+      nodes = atoll(argv[++i]);
+    } else if (arg == "--hash-mb" && i + 1 < argc) {
+      hash_mb = atoi(argv[++i]);
+    } else if (arg == "--tree" && i + 1 < argc) {
+      tree_depth = atoi(argv[++i]);
+    } else if (arg == "--openings") {
+      openings = true;
+    } else if (arg != "-" && arg[0] == '-') {
+      cerr << "Unknown option " << arg << endl;
+      return 1;
+    } else if (arg != "-") {
+      path = argv[i];
+    }
+  }
+
+  vector<pair<Board, char> > positions;
+  if (openings) {
+    for (int sq = 1; sq < 25; ++sq) {
       Board board;
       board.play(0, 0, P1);
-      board.play(i, j, P2);
-      play_match(P1, board);
+      board.play(sq / 5, sq % 5, P2);
+      positions.push_back(make_pair(board, P1));
+    }
+  } else {
+    ifstream file;
+    if (path != NULL) {
+      file.open(path);
+      if (!file) {
+        cerr << "Cannot open " << path << endl;
+        return 1;
+      }
+    }
+    istream& in = (path != NULL) ? file : cin;
+    string line;
+    while (getline(in, line)) {
+      if (line.empty()) continue;
+      Board board;
+      char player;
+      if (!parse_position(line, &board, &player)) {
+        cerr << "Invalid position " << line << endl;
+        return 1;
+      }
+      positions.push_back(make_pair(board, player));
+    }
+  }
+
+  ProofSearch search(hash_mb, nodes);
+  long long total_nodes = 0;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    Board& board = positions[i].first;
+    char player = positions[i].second;
+    long long start = monotonic_ns();
+    char winner = search.prove(board, player);
+    int move = (winner == player) ? search.winningMove() : 0;
+    long long elapsed = monotonic_ns() - start;
+    total_nodes += search.node_count;
+    printf("%s: %s", format_position(board, player).c_str(),
+           (winner == EMPTY) ? "unknown" : (winner == P1) ? "P1 wins" : "P2 wins");
+    if (move != 0) printf(" with %s", square_name(move).c_str());
+    printf(", %lld nodes, %lld ms\n", search.node_count, elapsed / 1000000);
+    if (winner != EMPTY && tree_depth > 0) {
+      ostringstream tree;
+      search.printTree(tree, tree_depth);
+      fputs(tree.str().c_str(), stdout);
     }
+    fflush(stdout);
   }
+  printf("Nodes searched  : %lld\n", total_nodes);
   return 0;
 }
 
-void play_match(char player, Board& board) {
-  int best_move;
-  Negamax negamax;
-  Negamax mirror;
-  int count = 0;
+// The outcome of one solve job: a position right after P1's first move,
+// by its canonical key. winner is EMPTY until it is proven.
+struct SolveJob {
+  PackedPosition key;
+  char winner;
+  long long nodes;
+};
 
-  while (true) { 
-    int ap_pos = (player == P1) ? board.p1 : board.p2;
-    int pp_pos = (player == P1) ? board.p2 : board.p1;
-    if (board.hasLost(ap_pos)) {
-      cout << "Player:" << PLAYER(player) << " Lost." << endl;
-      break;
+// Solves positions with both tokens placed and P1 to move, by proving
+// every position after P1's first move: P1 wins with exactly the moves
+// whose jobs it wins. Jobs run on all threads, each with its own df-pn
+// table, and the results are checkpointed to a text file ("key winner
+// nodes" lines) by writing a temporary file and renaming it, so that a
+// later run resumes from them. Jobs that ran out of nodes are retried.
+class Solver {
+ public:
+  Solver(int hash_mb, long long nodes, const string& checkpoint,
+         int checkpoint_secs)
+      : hash_mb(hash_mb), nodes(nodes), checkpoint(checkpoint),
+        checkpoint_secs(checkpoint_secs), next_job(0), jobs_done(0),
+        nodes_done(0) {}
+  // Adds the jobs of a position, P1 to move.
+  void addPosition(Board board);
+  // Reads the results of an earlier run. Returns false if the checkpoint
+  // exists but can't be read.
+  bool load();
+  // Returns false if writing a checkpoint failed.
+  bool run(int threads);
+  // The winner of a position added before, or EMPTY if some jobs are
+  // unknown, and P1's winning moves.
+  char outcome(Board board, vector<int>* winning_moves);
+
+ private:
+  int hash_mb;
+  long long nodes;
+  string checkpoint;
+  int checkpoint_secs;
+  vector<SolveJob> jobs;
+  unordered_map<PackedPosition, int> job_index;
+  vector<int> pending;
+  atomic<size_t> next_job;
+  atomic<long long> jobs_done;
+  atomic<long long> nodes_done;
+  mutex results_lock;
+
+  PackedPosition childKey(Board board, int move);
+  void worker();
+  bool save();
+};
+
+PackedPosition Solver::childKey(Board board, int move) {
+  board.play(POS_TO_X(move), POS_TO_Y(move), P1);
+  int transform;
+  return canonical_position(pack_position(board, P2), &transform);
+}
+
+void Solver::addPosition(Board board) {
+  int moves[32];
+  int count = list_moves(board, P1, moves);
+  for (int i = 0; i < count; ++i) {
+    PackedPosition key = childKey(board, moves[i]);
+    if (job_index.count(key)) continue;
+    job_index[key] = jobs.size();
+    SolveJob job = {key, EMPTY, 0};
+    jobs.push_back(job);
+  }
+}
+
+bool Solver::load() {
+  ifstream in(checkpoint.c_str());
+  if (!in) return true;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    unsigned long long key;
+    int winner;
+    long long job_nodes;
+    if (sscanf(line.c_str(), "%llx %d %lld", &key, &winner, &job_nodes) != 3 ||
+        winner < EMPTY || winner > P2) {
+      return false;
     }
-    
-    int best_move;
-    if (count % 2 == 0) {
-      best_move = mirror.getMove(&board, player, 25);
+    unordered_map<PackedPosition, int>::iterator it = job_index.find(key);
+    if (it == job_index.end()) continue;
+    jobs[it->second].winner = winner;
+    jobs[it->second].nodes = job_nodes;
+  }
+  return true;
+}
+
+bool Solver::save() {
+  ostringstream out;
+  out << "# solve checkpoint: key winner nodes\n";
+  {
+    lock_guard<mutex> lock(results_lock);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      if (jobs[i].nodes == 0) continue;
+      out << hex << jobs[i].key << dec << " " << (int)jobs[i].winner << " "
+          << jobs[i].nodes << "\n";
+    }
+  }
+  char tmp_path[32];
+  snprintf(tmp_path, sizeof(tmp_path), ".tmp.%d", (int)getpid());
+  string tmp = checkpoint + tmp_path;
+  string text = out.str();
+  FILE* file = fopen(tmp.c_str(), "w");
+  bool ok = file != NULL && fwrite(text.data(), 1, text.size(), file) == text.size();
+  if (file != NULL) ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0) && ok;
+  if (file != NULL) ok = (fclose(file) == 0) && ok;
+  ok = ok && rename(tmp.c_str(), checkpoint.c_str()) == 0;
+  if (!ok) unlink(tmp.c_str());
+  return ok;
+}
+
+bool Solver::run(int threads) {
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (jobs[i].winner == EMPTY) pending.push_back(i);
+  }
+  cerr << jobs.size() << " jobs, " << jobs.size() - pending.size()
+       << " solved before" << endl;
+  long long start = monotonic_ns();
+  vector<thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(thread(&Solver::worker, this));
+  }
+  // Progress on stderr while the workers run, and checkpoints.
+  bool ok = true;
+  long long last_report = start;
+  long long last_save = start;
+  long long total = pending.size();
+  while (jobs_done < total) {
+    this_thread::sleep_for(chrono::milliseconds(100));
+    long long now = monotonic_ns();
+    if (now - last_save >= checkpoint_secs * 1000000000LL) {
+      last_save = now;
+      if (!save()) {
+        cerr << "Failed writing " << checkpoint << endl;
+        ok = false;
+      }
+    }
+    if (now - last_report >= 5000000000LL) {
+      last_report = now;
+      double elapsed = (now - start) / 1e9;
+      long long done = jobs_done;
+      cerr << done << "/" << total << " jobs, "
+           << (long long)(nodes_done / elapsed) << " nodes/second, "
+           << (long long)elapsed << " s";
+      // Jobs differ a lot in size, so this is only a rough estimate.
+      if (done > 0) cerr << ", about " << (long long)(elapsed / done * (total - done)) << " s left";
+      cerr << endl;
+    }
+  }
+  for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+  if (!save()) {
+    cerr << "Failed writing " << checkpoint << endl;
+    ok = false;
+  }
+  double elapsed = (monotonic_ns() - start) / 1e9;
+  printf("Jobs            : %lld\n", total);
+  printf("Nodes searched  : %lld\n", (long long)nodes_done);
+  printf("Total time (ms) : %lld\n", (long long)(elapsed * 1000));
+  printf("Nodes/second    : %.0f\n", (elapsed > 0) ? nodes_done / elapsed : 0);
+  return ok;
+}
+
+void Solver::worker() {
+  ProofSearch search(hash_mb, nodes);
+  while (true) {
+    size_t i = next_job++;
+    if (i >= pending.size()) break;
+    Board board;
+    char player;
+    unpack_position(jobs[pending[i]].key, &board, &player);
+    char winner = search.prove(board, player);
+    {
+      lock_guard<mutex> lock(results_lock);
+      jobs[pending[i]].winner = winner;
+      jobs[pending[i]].nodes = max(search.node_count, 1LL);
+    }
+    nodes_done += search.node_count;
+    jobs_done++;
+  }
+}
+
+char Solver::outcome(Board board, vector<int>* winning_moves) {
+  int moves[32];
+  int count = list_moves(board, P1, moves);
+  bool unknown = false;
+  winning_moves->clear();
+  for (int i = 0; i < count; ++i) {
+    char winner = jobs[job_index[childKey(board, moves[i])]].winner;
+    if (winner == P1) winning_moves->push_back(moves[i]);
+    if (winner == EMPTY) unknown = true;
+  }
+  if (!winning_moves->empty()) return P1;
+  return unknown ? EMPTY : P2;
+}
+
+const char* winner_name(char winner) {
+  return (winner == EMPTY) ? "unknown" : (winner == P1) ? "P1 wins" : "P2 wins";
+}
+
+// solve [--nodes N] [--hash-mb N] [--threads N] [--checkpoint FILE]
+//       [--checkpoint-secs N] [--openings]
+// Solves the sweep openings, P1 at (0,0) against every P2 square, and
+// unless --openings is given free placement too: every placement of both
+// tokens, which decides P1's best first placements.
+int run_solve(int argc, char* argv[]) {
+  long long nodes = 1000000000;
+  int hash_mb = 256;
+  int threads = thread::hardware_concurrency();
+  string checkpoint = "solve.txt";
+  int checkpoint_secs = 60;
+  bool openings_only = false;
+  for (int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--nodes" && i + 1 < argc) {
+      nodes = atoll(argv[++i]);
+    } else if (arg == "--hash-mb" && i + 1 < argc) {
+      hash_mb = atoi(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      checkpoint = argv[++i];
+    } else if (arg == "--checkpoint-secs" && i + 1 < argc) {
+      checkpoint_secs = atoi(argv[++i]);
+    } else if (arg == "--openings") {
+      openings_only = true;
     } else {
-      best_move = negamax.getMove(&board, player, 25);
+      cerr << "Unknown option " << arg << endl;
+      return 1;
     }
-    count++;
-    int x, y; 
-    x = POS_TO_X(best_move);
-    y = POS_TO_Y(best_move);
-    cout << "Moved " << PLAYER(player) << " M: " << x << ", " << y << endl;
-    board.play(x, y, player);
-    board.printBoard();
-    cout << endl;
-    player = OPPONENT(player);
   }
+  if (threads < 1) threads = 1;
+
+  // The sweep openings go first, so that their results come early.
+  Solver solver(hash_mb, nodes, checkpoint, checkpoint_secs);
+  for (int sq = 1; sq < 25; ++sq) {
+    Board board;
+    board.play(0, 0, P1);
+    board.play(sq / 5, sq % 5, P2);
+    solver.addPosition(board);
+  }
+  // Placements are taken up to symmetry, as the search does.
+  vector<int> placements;
+  for (int sq = 0; sq < 25 && !openings_only; ++sq) {
+    Board board;
+    int transform;
+    board.play(sq / 5, sq % 5, P1);
+    PackedPosition key = canonical_position(pack_position(board, P2), &transform);
+    if (key != pack_position(board, P2)) continue;
+    placements.push_back(sq);
+    for (int reply = 0; reply < 25; ++reply) {
+      if (reply == sq) continue;
+      Board position = board;
+      position.play(reply / 5, reply % 5, P2);
+      solver.addPosition(position);
+    }
+  }
+  if (!solver.load()) {
+    cerr << "Invalid checkpoint " << checkpoint << endl;
+    return 1;
+  }
+  bool ok = solver.run(threads);
+
+  vector<int> moves;
+  for (int sq = 1; sq < 25; ++sq) {
+    Board board;
+    board.play(0, 0, P1);
+    board.play(sq / 5, sq % 5, P2);
+    char winner = solver.outcome(board, &moves);
+    printf("P1 00, P2 %d%d: %s", sq / 5, sq % 5, winner_name(winner));
+    for (size_t i = 0; i < moves.size(); ++i) {
+      printf("%s%s", i ? " " : " with ", square_name(moves[i]).c_str());
+    }
+    printf("\n");
+  }
+  // P1 wins with a placement if every reply leads to a P1 win, and P2
+  // refutes it with any reply that leads to a P2 win.
+  char first_winner = P2;
+  for (size_t i = 0; i < placements.size(); ++i) {
+    int sq = placements[i];
+    char winner = P1;
+    vector<int> refutations;
+    for (int reply = 0; reply < 25; ++reply) {
+      if (reply == sq) continue;
+      Board board;
+      board.play(sq / 5, sq % 5, P1);
+      board.play(reply / 5, reply % 5, P2);
+      char result = solver.outcome(board, &moves);
+      if (result == P2) refutations.push_back(reply);
+      if (result == EMPTY && winner == P1) winner = EMPTY;
+    }
+    if (!refutations.empty()) winner = P2;
+    printf("Placement P1 %d%d: %s", sq / 5, sq % 5, winner_name(winner));
+    for (size_t j = 0; j < refutations.size(); ++j) {
+      printf("%s%d%d", j ? " " : " with P2 ", refutations[j] / 5, refutations[j] % 5);
+    }
+    printf("\n");
+    if (winner == P1) first_winner = P1;
+    if (winner == EMPTY && first_winner == P2) first_winner = EMPTY;
+  }
+  if (!placements.empty()) printf("Free placement  : %s\n", winner_name(first_winner));
+  return ok ? 0 : 1;
 }